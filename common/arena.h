@@ -0,0 +1,65 @@
+// Arena allocation for solve phases that build many short lived
+// containers. PhaseArena is a std::pmr::monotonic_buffer_resource, so
+// any std::pmr container can allocate from it: allocation is a pointer
+// bump, deallocation is free, and everything is released at once when
+// the arena goes out of scope. The arena's requests to the system heap
+// go through a CountingResource and show up in the instrumentation
+// dump as arena_upstream_allocations and arena_upstream_bytes.
+#ifndef COMMON_ARENA_H_
+#define COMMON_ARENA_H_
+
+#include <cstddef>
+#include <memory_resource>
+
+#include "instrumentation.h"
+
+namespace arena {
+
+INSTR_COUNTER(upstream_allocations, "arena_upstream_allocations");
+INSTR_COUNTER(upstream_bytes, "arena_upstream_bytes");
+
+// Forwards to an upstream resource, counting what passes through
+class CountingResource : public std::pmr::memory_resource {
+ public:
+  explicit CountingResource(
+      std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+      : upstream_(upstream) {}
+
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    INSTR_COUNT(upstream_allocations, 1);
+    INSTR_COUNT(upstream_bytes, bytes);
+    return upstream_->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* ptr, size_t bytes, size_t alignment) override {
+    upstream_->deallocate(ptr, bytes, alignment);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource& other)
+      const noexcept override {
+    return this == &other;
+  }
+
+  std::pmr::memory_resource* upstream_;
+};
+
+// Monotonic arena for one phase of a solve. initial_bytes sizes the
+// first block; later blocks grow geometrically.
+class PhaseArena {
+ public:
+  explicit PhaseArena(size_t initial_bytes = 1 << 16)
+      : monotonic_(initial_bytes, &counting_) {}
+  PhaseArena(const PhaseArena&) = delete;
+  PhaseArena& operator=(const PhaseArena&) = delete;
+
+  std::pmr::memory_resource* resource() { return &monotonic_; }
+
+ private:
+  CountingResource counting_;
+  std::pmr::monotonic_buffer_resource monotonic_;
+};
+
+}  // namespace arena
+
+#endif  // COMMON_ARENA_H_
@@ -0,0 +1,222 @@
+// Lightweight counters and scoped timers for the solvers.
+//
+// Counters are declared once at namespace scope and bumped on the hot
+// path with INSTR_COUNT. Every thread writes its own slot with a
+// relaxed atomic store, so counting costs an add and a store with no
+// sharing between threads; a dump sums the slots of all live threads
+// plus whatever exited threads left behind. INSTR_SCOPED_TIMER adds
+// the calls and nanoseconds spent in a scope to a timer.
+//
+// instrumentation::install_dump("name") prints every counter as JSON
+// to stderr when the program exits and whenever it receives SIGUSR1,
+// together with the peak resident set size. Build with
+// -DINSTR_COUNT_HEAP to also count every global operator new, and with
+// -DDISABLE_INSTRUMENTATION to compile all of it out.
+#ifndef COMMON_INSTRUMENTATION_H_
+#define COMMON_INSTRUMENTATION_H_
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <set>
+#include <string>
+#include <thread>
+
+namespace instrumentation {
+
+static const int kMaxCounters = 64;
+
+// Plain atomics rather than a Counter: the first counter use on a
+// thread allocates, which must not recurse into a counting operator new
+inline std::atomic<uint64_t>& heap_allocations() {
+  static std::atomic<uint64_t> count(0);
+  return count;
+}
+
+struct ThreadSlots;
+
+// Process wide bookkeeping. Function local statics so counters may be
+// declared at namespace scope in any translation unit.
+struct Registry {
+  std::mutex mutex;
+  const char* names[kMaxCounters];
+  int n_counters = 0;
+  std::set<ThreadSlots*> live_threads;
+  uint64_t retired[kMaxCounters] = {};
+  std::string program;
+
+  static Registry& get() {
+    static Registry registry;
+    return registry;
+  }
+};
+
+struct ThreadSlots {
+  std::atomic<uint64_t> values[kMaxCounters];
+
+  ThreadSlots() {
+    for (auto& value : values)
+      value.store(0, std::memory_order_relaxed);
+    Registry& registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.live_threads.insert(this);
+  }
+
+  ~ThreadSlots() {
+    Registry& registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (int i = 0; i < kMaxCounters; ++i)
+      registry.retired[i] += values[i].load(std::memory_order_relaxed);
+    registry.live_threads.erase(this);
+  }
+
+  static ThreadSlots& local() {
+    thread_local ThreadSlots slots;
+    return slots;
+  }
+};
+
+class Counter {
+ public:
+  explicit Counter(const char* name) {
+    Registry& registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    if (registry.n_counters < kMaxCounters) {
+      id_ = registry.n_counters++;
+      registry.names[id_] = name;
+    } else {
+      id_ = -1;
+    }
+  }
+
+  void add(uint64_t n = 1) const {
+    if (id_ < 0)
+      return;
+    std::atomic<uint64_t>& slot = ThreadSlots::local().values[id_];
+    // Only this thread writes the slot, so no read-modify-write needed
+    slot.store(slot.load(std::memory_order_relaxed) + n,
+               std::memory_order_relaxed);
+  }
+
+ private:
+  int id_;
+};
+
+// A pair of counters: how often a scope ran and for how long
+class Timer {
+ public:
+  Timer(const char* calls_name, const char* ns_name)
+      : calls_(calls_name), nanoseconds_(ns_name) {}
+
+  void record(uint64_t ns) const {
+    calls_.add(1);
+    nanoseconds_.add(ns);
+  }
+
+ private:
+  Counter calls_;
+  Counter nanoseconds_;
+};
+
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(const Timer& timer)
+      : timer_(timer), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    timer_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_).count());
+  }
+
+ private:
+  const Timer& timer_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+inline void dump_json(FILE* out) {
+  Registry& registry = Registry::get();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  fprintf(out, "{\"program\": \"%s\", \"counters\": {",
+          registry.program.c_str());
+  for (int i = 0; i < registry.n_counters; ++i) {
+    uint64_t total = registry.retired[i];
+    for (ThreadSlots* slots : registry.live_threads)
+      total += slots->values[i].load(std::memory_order_relaxed);
+    fprintf(out, "%s\"%s\": %llu", i == 0 ? "" : ", ", registry.names[i],
+            static_cast<unsigned long long>(total));
+  }
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out, "}, \"peak_rss_kb\": %ld", usage.ru_maxrss);
+#ifdef INSTR_COUNT_HEAP
+  fprintf(out, ", \"heap_allocations\": %llu",
+          static_cast<unsigned long long>(heap_allocations().load()));
+#endif
+  fprintf(out, "}\n");
+  fflush(out);
+}
+
+// Must be called from main before any other thread starts: SIGUSR1 is
+// blocked here, which every later thread inherits, and a helper thread
+// collects it with sigwait so the dump never runs in a signal handler.
+inline void install_dump(const char* program) {
+  Registry::get().program = program;
+  atexit([]() { dump_json(stderr); });
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  std::thread([signals]() {
+    int signal_number;
+    while (sigwait(&signals, &signal_number) == 0)
+      dump_json(stderr);
+  }).detach();
+}
+
+}  // namespace instrumentation
+
+#if defined(INSTR_COUNT_HEAP) && !defined(DISABLE_INSTRUMENTATION)
+// Replacement allocation functions. Each program is a single
+// translation unit, so defining them in this header is safe. Kept
+// out of line so GCC does not pair the inlined free with operator new.
+__attribute__((noinline)) void* operator new(size_t size) {
+  instrumentation::heap_allocations().fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+#endif
+
+#ifdef DISABLE_INSTRUMENTATION
+#define INSTR_COUNTER(var, name)
+#define INSTR_TIMER(var, name)
+#define INSTR_COUNT(var, n)
+#define INSTR_SCOPED_TIMER(var)
+#define INSTR_INSTALL_DUMP(program)
+#else
+#define INSTR_COUNTER(var, name) \
+  static const instrumentation::Counter var(name)
+#define INSTR_TIMER(var, name) \
+  static const instrumentation::Timer var(name "_calls", name "_ns")
+#define INSTR_COUNT(var, n) (var).add(n)
+#define INSTR_CONCAT_INNER(a, b) a##b
+#define INSTR_CONCAT(a, b) INSTR_CONCAT_INNER(a, b)
+#define INSTR_SCOPED_TIMER(var) \
+  instrumentation::ScopedTimer INSTR_CONCAT(scoped_timer_, __LINE__)(var)
+#define INSTR_INSTALL_DUMP(program) instrumentation::install_dump(program)
+#endif
+
+#endif  // COMMON_INSTRUMENTATION_H_
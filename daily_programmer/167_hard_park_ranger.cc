@@ -2,13 +2,28 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <memory_resource>
 #include <numeric>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 #include <queue>
 #include <utility>
 
 #include <csignal> 
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch_runner.h"
+#include "../common/arena.h"
+#include "../common/instrumentation.h"
 
 using std::string;
 using std::vector;
@@ -18,33 +33,49 @@ char kInputFile1[] = "park_ranger_input_1.txt";
 char kInputFile2[] = "park_ranger_input_2.txt";
 char kInputFile3[] = "park_ranger_input_3.txt";
 
-typedef vector<pair<int, int>> pair_vector;
+typedef std::pmr::vector<pair<int, int>> pair_vector;
+
+INSTR_COUNTER(heap_pushes, "shortest_paths_heap_pushes");
+INSTR_COUNTER(stale_pops, "shortest_paths_stale_pops");
+INSTR_COUNTER(pairings_evaluated, "route_inspection_pairings_evaluated");
+INSTR_TIMER(shortest_paths_timer, "shortest_paths");
+INSTR_COUNTER(flow_rounds, "min_cost_flow_rounds");
+INSTR_COUNTER(flow_augmentations, "min_cost_flow_augmentations");
+INSTR_TIMER(route_inspection_timer, "route_inspection");
+INSTR_TIMER(directed_postman_timer, "directed_postman");
+INSTR_COUNTER(shard_rounds, "sharded_paths_rounds");
+INSTR_COUNTER(shard_updates, "sharded_paths_boundary_updates");
 
-void pair_comb_recursive(vector<pair_vector>* output,
+// Every container here allocates from the resource passed to
+// pair_comb, so the per level remainders are pointer bumps
+void pair_comb_recursive(std::pmr::vector<pair_vector>* output,
 			 pair_vector* pairs_so_far,
-			 const vector<int>& remainder) {
+			 const std::pmr::vector<int>& remainder) {
   if (remainder.size() == 0) {
     output->push_back(*pairs_so_far);
-  } else {
-    for (auto sec_iter = ++remainder.cbegin();
-         sec_iter != remainder.cend(); ++sec_iter) {
-      pair<int, int> cur_pair = std::make_pair(*(remainder.cbegin()),
-                                               *sec_iter);
-      pairs_so_far->push_back(cur_pair);
-      vector<int> new_remainder(remainder.size() - 2);
-      auto end_iter = std::copy(++remainder.cbegin(), sec_iter, new_remainder.begin());
-      std::copy(sec_iter + 1, remainder.cend(), end_iter);
-      pair_comb_recursive(output, pairs_so_far, new_remainder);
-    }
+    return;
+  }
+  for (auto sec_iter = ++remainder.cbegin();
+       sec_iter != remainder.cend(); ++sec_iter) {
+    pair<int, int> cur_pair = std::make_pair(*(remainder.cbegin()),
+                                             *sec_iter);
+    pairs_so_far->push_back(cur_pair);
+    std::pmr::vector<int> new_remainder(remainder.size() - 2,
+                                        remainder.get_allocator());
+    auto end_iter = std::copy(++remainder.cbegin(), sec_iter, new_remainder.begin());
+    std::copy(sec_iter + 1, remainder.cend(), end_iter);
+    pair_comb_recursive(output, pairs_so_far, new_remainder);
+    pairs_so_far->pop_back();
   }
-  pairs_so_far->pop_back();
 }
 
-vector<pair_vector> pair_comb(int n_elements) {
-  pair_vector pairs_so_far;
-  vector<pair_vector> all_combinations;
+std::pmr::vector<pair_vector> pair_comb(int n_elements,
+                                        std::pmr::memory_resource* resource) {
+  pair_vector pairs_so_far(resource);
+  std::pmr::vector<pair_vector> all_combinations(resource);
   if (n_elements%2 == 0) {
-    vector<int> remainder(n_elements);
+    pairs_so_far.reserve(n_elements/2);
+    std::pmr::vector<int> remainder(n_elements, resource);
     std::iota(remainder.begin(), remainder.end(), 0);
     pair_comb_recursive(&all_combinations, &pairs_so_far, remainder);
   }
@@ -58,55 +89,105 @@ struct DirectedEdge {
   int to;
 };
 
+// Reads the first line of the text format given on reddit: the
+// number of nodes, followed by an n x n matrix of edge weights with -1
+// for no edge. Throws std::invalid_argument (from stoi too) if it is
+// not a node count.
+int read_matrix_size(std::istream* in_file) {
+  string line;
+  int n_nodes = getline(*in_file, line) ? std::stoi(line) : 0;
+  if (n_nodes < 0)
+    throw std::invalid_argument("negative number of nodes");
+  return n_nodes;
+}
+
+// Calls visit for every edge in the matrix rows [first_row, end_row),
+// in row then column order. The edge goes from row to collumn. Lines
+// outside the range are skipped without being parsed, so a caller
+// that only needs some rows never tokenizes the rest. Throws
+// std::invalid_argument if a parsed row does not fit the format.
+template <typename Visit>
+void for_each_matrix_edge(std::istream* in_file, int n_nodes, int first_row,
+                          int end_row, Visit visit) {
+  string line;
+  for (int row = 0; row < end_row && getline(*in_file, line); ++row) {
+    if (row < first_row)
+      continue;
+    std::istringstream line_stream(line);
+    string edge_str;
+    int collumn = 0;
+    // For each line, loop over each comma separated value
+    while (getline(line_stream, edge_str, ',')) {
+      int weight = std::stoi(edge_str);
+      if (weight < -1)
+        throw std::invalid_argument("negative edge weight");
+      if (weight != -1 && (row >= n_nodes || collumn >= n_nodes))
+        throw std::invalid_argument("edge outside the matrix");
+      if (weight != -1)
+        visit(DirectedEdge{weight, row, collumn});
+      ++collumn;
+    }
+  }
+}
+
 // Adjacency based directed graph representation. Stolen in large part
 // from Sedgwick's implementation
 class DirectedGraph {
  public:
-  // Construct the graph from a text file that uses the representation
-  // given on reddit. The first line gives the number of nodes and
-  // then a n x n matrix is given
-  explicit DirectedGraph(std::ifstream* in_file) {
-    string line;
-    if (getline(*in_file, line))
-      n_nodes_ = std::stoi(line);
-    else
-      n_nodes_ = 0;
+  // Construct the graph from a text file in the matrix format of
+  // read_matrix_size. The edge and adjacency storage allocates from
+  // resource. Throws std::invalid_argument (from stoi too) if the file
+  // does not fit that format.
+  explicit DirectedGraph(
+      std::istream* in_file,
+      std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+      : adj_list_(resource), edges_(resource), n_edges_(0) {
+    n_nodes_ = read_matrix_size(in_file);
     adj_list_.resize(n_nodes_);
-    int row = 0;
-    n_edges_ = 0;
-    // Edge goes from row to collumn
-    while (getline(*in_file, line)) {
-      std::istringstream line_stream(line);
-      string edge_str;
-      int collumn = 0;
-      // For each line, loop over each comma separated value
-      while (getline(line_stream, edge_str, ',')) {
-        int weight = std::stoi(edge_str);
-        if (weight != -1) {
-          DirectedEdge temp_edge = {weight, row, collumn};
-          edges_.push_back(temp_edge);
-          adj_list_[row].push_back(n_edges_);
-          ++n_edges_;
-        }
-        ++collumn;
-      }
-      ++row;
-    }
+    for_each_matrix_edge(in_file, n_nodes_, 0,
+                         std::numeric_limits<int>::max(),
+                         [&](const DirectedEdge& edge) {
+                           edges_.push_back(edge);
+                           adj_list_[edge.from].push_back(n_edges_);
+                           ++n_edges_;
+                         });
   }
 
   // Return all the edges emminating from this node
   vector<DirectedEdge> adj(int node) const {
     vector<DirectedEdge> return_val;
     if (node < n_nodes_) {
-      vector<int> adj_indices(adj_list_[node]);
-      for (auto edge_it = adj_indices.cbegin();
-           edge_it < adj_indices.cend(); ++edge_it)
+      for (auto edge_it = adj_list_[node].cbegin();
+           edge_it < adj_list_[node].cend(); ++edge_it)
         return_val.push_back(edges_[*edge_it]);
     }
     return return_val;
   }
 
-  vector<DirectedEdge> edges() const { return vector<DirectedEdge>(edges_); }
+  // Construct the graph from a list of edges
+  DirectedGraph(
+      int n_nodes, const vector<DirectedEdge>& edges,
+      std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+      : adj_list_(n_nodes, resource), edges_(resource),
+        n_nodes_(n_nodes), n_edges_(0) {
+    edges_.reserve(edges.size());
+    for (auto edge_it = edges.cbegin(); edge_it < edges.cend(); ++edge_it) {
+      edges_.push_back(*edge_it);
+      adj_list_[edge_it->from].push_back(n_edges_);
+      ++n_edges_;
+    }
+  }
+
+  // Indices into the edge list of the edges emminating from this
+  // node. Unlike adj() this does not copy.
+  const std::pmr::vector<int>& adj_indices(int node) const {
+    return adj_list_[node];
+  }
+  const DirectedEdge& edge(int idx) const { return edges_[idx]; }
+
+  vector<DirectedEdge> edges() const {
+    return vector<DirectedEdge>(edges_.cbegin(), edges_.cend());
+  }
 
   string to_string() const {
     string out_string;
@@ -116,7 +197,7 @@ class DirectedGraph {
          node_it < adj_list_.cend(); ++node_it) {
       // Print the current node number
       out_string += "From: " + std::to_string(from_node) + " To: ";
-      vector<int> cur_v = *node_it;
+      const std::pmr::vector<int>& cur_v = *node_it;
       // Loop over each edge from this node
       for (auto edge_it = cur_v.cbegin(); edge_it < cur_v.cend(); ++edge_it) {
         out_string += std::to_string(edges_[*edge_it].to) + ":"
@@ -132,12 +213,26 @@ class DirectedGraph {
     return adj_list_[i].size();
   }
 
+  // True if every edge has a twin going back with the same weight,
+  // i.e. the graph is really undirected
+  bool is_symmetric() const {
+    for (auto edge_it = edges_.cbegin(); edge_it < edges_.cend(); ++edge_it) {
+      const auto& back = adj_list_[edge_it->to];
+      if (std::none_of(back.cbegin(), back.cend(), [&](int idx) {
+            return edges_[idx].to == edge_it->from &&
+                   edges_[idx].weight == edge_it->weight;
+          }))
+        return false;
+    }
+    return true;
+  }
+
   int n_nodes() const { return n_nodes_; }
   int n_edges() const { return n_edges_; }
 
  private:
-  vector<vector<int>> adj_list_;
-  vector<DirectedEdge> edges_;
+  std::pmr::vector<std::pmr::vector<int>> adj_list_;
+  std::pmr::vector<DirectedEdge> edges_;
   int n_nodes_;
   int n_edges_;
 };
@@ -147,39 +242,507 @@ class DirectedGraph {
 class ShortestPaths {
  public:
   explicit ShortestPaths(const DirectedGraph& in_graph, int from_node) {
+    INSTR_SCOPED_TIMER(shortest_paths_timer);
     dist_to_.resize(in_graph.n_nodes(), std::numeric_limits<int>::max());
+    edge_to_.resize(in_graph.n_nodes(), -1);
     dist_to_[from_node] = 0;
     min_queue_.push(std::make_pair(0, from_node));
+    INSTR_COUNT(heap_pushes, 1);
     while (!min_queue_.empty()) {
       pair<int, int> cur_pair = min_queue_.top();
       min_queue_.pop();
+      // A shorter path to this node was found after this entry was
+      // pushed, so it has already been relaxed
+      if (cur_pair.first > dist_to_[cur_pair.second]) {
+        INSTR_COUNT(stale_pops, 1);
+        continue;
+      }
       relax_node(in_graph, cur_pair.second);
     }
   }
 
-  int min_dist(int node) { return dist_to_[node]; }
+  int min_dist(int node) const { return dist_to_[node]; }
+  bool has_path_to(int node) const {
+    return dist_to_[node] != std::numeric_limits<int>::max();
+  }
+  // Index of the last edge on the shortest path to node, or -1
+  int edge_to(int node) const { return edge_to_[node]; }
 
  private:
   void relax_node(const DirectedGraph& in_graph, int node_n) {
-    vector<DirectedEdge> adj = in_graph.adj(node_n);
+    const std::pmr::vector<int>& adj = in_graph.adj_indices(node_n);
     int ini_dist = dist_to_[node_n];
-    for (auto edge_it = adj.cbegin(); edge_it < adj.cend(); ++edge_it) {
-      int to_node = edge_it->to;
-      int new_dist = edge_it->weight + ini_dist;
+    for (auto idx_it = adj.cbegin(); idx_it < adj.cend(); ++idx_it) {
+      const DirectedEdge& cur_edge = in_graph.edge(*idx_it);
+      int to_node = cur_edge.to;
+      int new_dist = cur_edge.weight + ini_dist;
       if (dist_to_[to_node] > new_dist) {
         dist_to_[to_node] = new_dist;
+        edge_to_[to_node] = *idx_it;
         min_queue_.push(std::make_pair(dist_to_[to_node], to_node));
+        INSTR_COUNT(heap_pushes, 1);
       }
     }
   }
 
   vector<int> dist_to_;
+  vector<int> edge_to_;
   std::priority_queue<pair<int, int>,
                       vector<pair<int, int>>,
                       std::greater<pair<int, int>>> min_queue_;
 };
 
 
+// A shorter path to node from source found by the shard that owns the
+// last edge of the path
+struct BoundaryUpdate {
+  int node;
+  int source;
+  int dist;
+};
+
+// Where the shard workers read the graph from. A matrix file is the
+// format read by DirectedGraph; a trail bench is the random network of
+// visit_bench_trails, which every worker regenerates from its seed.
+enum ShardInput { kMatrixFile, kTrailBench };
+
+struct ShardSpec {
+  ShardInput input;
+  int n_nodes;
+  // Random trails on top of the ring, for kTrailBench
+  int n_extra;
+  // For kMatrixFile
+  string path;
+};
+
+// Calls visit for every edge of a random two-way network: a ring
+// through every node plus n_extra random trails, each trail as an
+// edge in both directions. The seed is fixed, so every process that
+// calls this sees the same network.
+template <typename Visit>
+void visit_bench_trails(int n_nodes, int n_extra, Visit visit) {
+  std::mt19937 gen(50);
+  std::uniform_int_distribution<int> node(0, n_nodes - 1);
+  std::uniform_int_distribution<int> weight(1, 100);
+  for (int i = 0; i < n_nodes; ++i) {
+    int w = weight(gen);
+    visit(DirectedEdge{w, i, (i + 1) % n_nodes});
+    visit(DirectedEdge{w, (i + 1) % n_nodes, i});
+  }
+  for (int i = 0; i < n_extra; ++i) {
+    int from = node(gen);
+    int to = node(gen);
+    int w = weight(gen);
+    if (from != to) {
+      visit(DirectedEdge{w, from, to});
+      visit(DirectedEdge{w, to, from});
+    }
+  }
+}
+
+// The nodes [first_node, end_node) of a graph split into shards. Holds
+// the out edges of those nodes and their distances from every source,
+// and only learns about the rest of the graph through boundary
+// updates sent by the other shards.
+class DistanceShard {
+ public:
+  DistanceShard(int n_sources, int first_node, int end_node)
+      : first_node_(first_node), end_node_(end_node),
+        n_sources_(n_sources),
+        dist_(static_cast<size_t>(end_node - first_node) * n_sources,
+              std::numeric_limits<int>::max()) {}
+
+  // Reads the out edges of the owned nodes, and nothing else, from the
+  // input spec names. Returns false if it cannot be read.
+  bool load(const ShardSpec& spec) {
+    vector<DirectedEdge> owned;
+    auto keep = [&](const DirectedEdge& edge) {
+      if (owns(edge.from))
+        owned.push_back(edge);
+    };
+    if (spec.input == kTrailBench) {
+      visit_bench_trails(spec.n_nodes, spec.n_extra, keep);
+    } else {
+      std::ifstream in_file(spec.path);
+      if (!in_file)
+        return false;
+      try {
+        if (read_matrix_size(&in_file) != spec.n_nodes)
+          return false;
+        for_each_matrix_edge(&in_file, spec.n_nodes, first_node_, end_node_,
+                             keep);
+      } catch (const std::exception&) {
+        return false;
+      }
+    }
+    // Bucket the edges by their owned start node, keeping their order
+    edge_begin_.assign(end_node_ - first_node_ + 1, 0);
+    for (const auto& edge : owned)
+      ++edge_begin_[edge.from - first_node_ + 1];
+    std::partial_sum(edge_begin_.begin(), edge_begin_.end(),
+                     edge_begin_.begin());
+    edges_.resize(owned.size());
+    vector<int> fill(edge_begin_.cbegin(), edge_begin_.cend() - 1);
+    for (const auto& edge : owned)
+      edges_[fill[edge.from - first_node_]++] = edge;
+    return true;
+  }
+
+  bool owns(int node) const {
+    return node >= first_node_ && node < end_node_;
+  }
+
+  int dist(int node, int source) const {
+    return dist_[index(node, source)];
+  }
+
+  // Lowers the distance of an owned node from source, if dist is
+  // shorter, and queues the node to be relaxed
+  void offer(int node, int source, int dist) {
+    int& cur_dist = dist_[index(node, source)];
+    if (dist < cur_dist) {
+      cur_dist = dist;
+      min_queue_.push(std::make_tuple(dist, node, source));
+    }
+  }
+
+  // Smallest distance still waiting to be relaxed
+  int next_dist() const {
+    return min_queue_.empty() ? std::numeric_limits<int>::max()
+                              : std::get<0>(min_queue_.top());
+  }
+
+  // Runs Dijkstra's algorithm inside the shard from every queued node
+  // closer than bound. Paths that leave the shard are appended to
+  // boundary, keeping only the shortest per node and source.
+  void relax(int bound, vector<BoundaryUpdate>* boundary) {
+    boundary->clear();
+    while (next_dist() < bound) {
+      int cur_dist, node, source;
+      std::tie(cur_dist, node, source) = min_queue_.top();
+      min_queue_.pop();
+      if (cur_dist > dist(node, source))
+        continue;
+      int local = node - first_node_;
+      for (int i = edge_begin_[local]; i < edge_begin_[local + 1]; ++i) {
+        int new_dist = cur_dist + edges_[i].weight;
+        if (owns(edges_[i].to))
+          offer(edges_[i].to, source, new_dist);
+        else
+          boundary->push_back({edges_[i].to, source, new_dist});
+      }
+    }
+    std::sort(boundary->begin(), boundary->end(),
+              [](const BoundaryUpdate& a, const BoundaryUpdate& b) {
+                return std::tie(a.node, a.source, a.dist) <
+                       std::tie(b.node, b.source, b.dist);
+              });
+    boundary->erase(
+        std::unique(boundary->begin(), boundary->end(),
+                    [](const BoundaryUpdate& a, const BoundaryUpdate& b) {
+                      return a.node == b.node && a.source == b.source;
+                    }),
+        boundary->end());
+  }
+
+ private:
+  size_t index(int node, int source) const {
+    return static_cast<size_t>(node - first_node_) * n_sources_ + source;
+  }
+
+  int first_node_;
+  int end_node_;
+  int n_sources_;
+  vector<int> edge_begin_;
+  vector<DirectedEdge> edges_;
+  vector<int> dist_;
+  std::priority_queue<std::tuple<int, int, int>,
+                      vector<std::tuple<int, int, int>>,
+                      std::greater<std::tuple<int, int, int>>> min_queue_;
+};
+
+// Sent by a shard at the end of every round, before its updates
+struct ShardReport {
+  int n_updates;
+  int next_dist;
+};
+
+// Sent by the coordinator to start every round, before the updates
+// for that shard. Only distances under bound are relaxed in the round.
+struct RoundHeader {
+  int done;
+  int n_updates;
+  int bound;
+};
+
+bool write_all(int fd, const void* buf, size_t size) {
+  const char* pos = static_cast<const char*>(buf);
+  while (size > 0) {
+    ssize_t n = write(fd, pos, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    pos += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool read_all(int fd, void* buf, size_t size) {
+  char* pos = static_cast<char*>(buf);
+  while (size > 0) {
+    ssize_t n = read(fd, pos, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    pos += n;
+    size -= n;
+  }
+  return true;
+}
+
+// One computation for a shard worker, followed by the path bytes and
+// the n_sources source nodes
+struct ShardJob {
+  int input;
+  int n_nodes;
+  int n_extra;
+  int first_node;
+  int end_node;
+  int n_sources;
+  int path_size;
+};
+
+// Rounds of one job on a shard worker. Each round it relaxes what it
+// was sent up to the round's bound and reports the updates that cross
+// into other shards. Once nothing is left anywhere it writes the
+// distances of the sources it owns, one row of n_sources per owned
+// source.
+bool run_shard_worker(int fd, DistanceShard* shard,
+                      const vector<int>& sources) {
+  for (size_t i = 0; i < sources.size(); ++i) {
+    if (shard->owns(sources[i]))
+      shard->offer(sources[i], i, 0);
+  }
+  vector<BoundaryUpdate> updates;
+  while (true) {
+    ShardReport report = {static_cast<int>(updates.size()),
+                          shard->next_dist()};
+    if (!write_all(fd, &report, sizeof(report)) ||
+        !write_all(fd, updates.data(),
+                   updates.size() * sizeof(BoundaryUpdate)))
+      return false;
+    RoundHeader header;
+    if (!read_all(fd, &header, sizeof(header)))
+      return false;
+    updates.resize(header.n_updates);
+    if (!read_all(fd, updates.data(),
+                  header.n_updates * sizeof(BoundaryUpdate)))
+      return false;
+    for (auto update_it = updates.cbegin(); update_it < updates.cend();
+         ++update_it)
+      shard->offer(update_it->node, update_it->source, update_it->dist);
+    if (header.done)
+      break;
+    shard->relax(header.bound, &updates);
+  }
+  vector<int> row(sources.size());
+  for (size_t j = 0; j < sources.size(); ++j) {
+    if (!shard->owns(sources[j]))
+      continue;
+    for (size_t i = 0; i < sources.size(); ++i)
+      row[i] = shard->dist(sources[j], i);
+    if (!write_all(fd, row.data(), row.size() * sizeof(int)))
+      return false;
+  }
+  return true;
+}
+
+// Body of a forked shard worker: answers jobs until the pool closes
+// its socket. A shard that cannot load its part of the graph reports
+// -1 updates in place of its first round.
+void run_shard_jobs(int fd) {
+  ShardJob job;
+  while (read_all(fd, &job, sizeof(job))) {
+    string path(job.path_size, '\0');
+    vector<int> sources(job.n_sources);
+    if (!read_all(fd, &path[0], path.size()) ||
+        !read_all(fd, sources.data(), sources.size() * sizeof(int)))
+      return;
+    ShardSpec spec = {static_cast<ShardInput>(job.input), job.n_nodes,
+                      job.n_extra, path};
+    DistanceShard shard(job.n_sources, job.first_node, job.end_node);
+    if (!shard.load(spec)) {
+      ShardReport failed = {-1, 0};
+      if (!write_all(fd, &failed, sizeof(failed)))
+        return;
+      continue;
+    }
+    if (!run_shard_worker(fd, &shard, sources))
+      return;
+  }
+}
+
+// Local worker processes that each own a contiguous range of nodes
+// and load only the edges leaving them, so no process ever holds the
+// whole graph. The workers talk to this process over socket pairs,
+// which routes each round's boundary updates to the shards that own
+// them. They are forked once, up front, and serve one job per graph.
+// Fork before any other thread starts, since a child only keeps the
+// thread that forked it.
+class ShardPool {
+ public:
+  explicit ShardPool(int n_workers) : broken_(false) {
+    for (int w = 0; w < n_workers; ++w) {
+      int pair_fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair_fds) != 0) {
+        printf("socketpair failed: %s\n", strerror(errno));
+        broken_ = true;
+        return;
+      }
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid < 0) {
+        printf("fork failed: %s\n", strerror(errno));
+        close(pair_fds[0]);
+        close(pair_fds[1]);
+        broken_ = true;
+        return;
+      }
+      if (pid == 0) {
+        close(pair_fds[0]);
+        for (auto fd_it = fds_.cbegin(); fd_it < fds_.cend(); ++fd_it)
+          close(*fd_it);
+        run_shard_jobs(pair_fds[1]);
+        // Skip the parent's exit handlers and stdio buffers
+        _exit(0);
+      }
+      close(pair_fds[1]);
+      fds_.push_back(pair_fds[0]);
+      pids_.push_back(pid);
+    }
+  }
+
+  // Closing the sockets ends the workers
+  ~ShardPool() {
+    close_sockets();
+    for (pid_t pid : pids_)
+      waitpid(pid, NULL, 0);
+  }
+
+  int size() const { return fds_.size(); }
+
+  // Shortest distances between every pair of sources in the graph
+  // that spec names, with max_weight its largest edge weight. The
+  // result is the row major matrix of distances from sources[i] to
+  // sources[j]. A round only settles distances within delta of the
+  // closest pending node, as in delta stepping, so shards rarely relax
+  // a path that a later update from another shard undercuts. Delta
+  // starts at the largest edge weight and doubles while rounds cross
+  // no shard boundaries, which keeps long sparse trails from taking a
+  // round per edge. Returns false if a worker failed or could not
+  // load its shard; the pool is unusable after that.
+  bool distances(const ShardSpec& spec, int max_weight,
+                 const vector<int>& sources, vector<int>* dist) {
+    if (broken_ || fds_.empty())
+      return false;
+    int n_nodes = spec.n_nodes;
+    int n_sources = sources.size();
+    int n_shards = std::max(1, std::min<int>(fds_.size(), n_nodes));
+    vector<int> first_node(n_shards + 1);
+    for (int s = 0; s <= n_shards; ++s)
+      first_node[s] = static_cast<long long>(s) * n_nodes / n_shards;
+    auto owner = [&](int node) {
+      return std::upper_bound(first_node.cbegin(), first_node.cend(),
+                              node) - first_node.cbegin() - 1;
+    };
+    int min_delta = std::max(1, max_weight);
+    int delta = min_delta;
+
+    bool ok = true;
+    for (int s = 0; ok && s < n_shards; ++s) {
+      ShardJob job = {spec.input, n_nodes, spec.n_extra, first_node[s],
+                      first_node[s + 1], n_sources,
+                      static_cast<int>(spec.path.size())};
+      ok = write_all(fds_[s], &job, sizeof(job)) &&
+           write_all(fds_[s], spec.path.data(), spec.path.size()) &&
+           write_all(fds_[s], sources.data(), sources.size() * sizeof(int));
+    }
+    vector<vector<BoundaryUpdate>> outbox(n_shards);
+    vector<BoundaryUpdate> received;
+    bool done = false;
+    while (ok && !done) {
+      INSTR_COUNT(shard_rounds, 1);
+      for (auto& box : outbox)
+        box.clear();
+      long long n_routed = 0;
+      int next_dist = std::numeric_limits<int>::max();
+      for (int s = 0; ok && s < n_shards; ++s) {
+        ShardReport report;
+        ok = read_all(fds_[s], &report, sizeof(report)) &&
+            report.n_updates >= 0;
+        received.resize(ok ? report.n_updates : 0);
+        ok = ok && read_all(fds_[s], received.data(),
+                            received.size() * sizeof(BoundaryUpdate));
+        next_dist = std::min(next_dist, ok ? report.next_dist : 0);
+        for (auto update_it = received.cbegin();
+             update_it < received.cend(); ++update_it) {
+          outbox[owner(update_it->node)].push_back(*update_it);
+          next_dist = std::min(next_dist, update_it->dist);
+        }
+        n_routed += received.size();
+      }
+      INSTR_COUNT(shard_updates, n_routed);
+      if (n_routed == 0)
+        delta = std::min(delta, std::numeric_limits<int>::max() / 2) * 2;
+      else
+        delta = std::max(min_delta, delta / 2);
+      done = next_dist == std::numeric_limits<int>::max();
+      int bound = next_dist > std::numeric_limits<int>::max() - delta
+          ? std::numeric_limits<int>::max() : next_dist + delta;
+      for (int s = 0; ok && s < n_shards; ++s) {
+        RoundHeader header = {done, static_cast<int>(outbox[s].size()),
+                              bound};
+        ok = write_all(fds_[s], &header, sizeof(header)) &&
+             write_all(fds_[s], outbox[s].data(),
+                       outbox[s].size() * sizeof(BoundaryUpdate));
+      }
+    }
+
+    dist->assign(static_cast<size_t>(n_sources) * n_sources, 0);
+    vector<int> row(n_sources);
+    for (int s = 0; ok && s < n_shards; ++s) {
+      for (int j = 0; ok && j < n_sources; ++j) {
+        if (owner(sources[j]) != s)
+          continue;
+        ok = read_all(fds_[s], row.data(), row.size() * sizeof(int));
+        for (int i = 0; i < n_sources; ++i)
+          (*dist)[static_cast<size_t>(i) * n_sources + j] = row[i];
+      }
+    }
+    // The workers are out of step after a failure, so they are let go
+    if (!ok) {
+      broken_ = true;
+      close_sockets();
+    }
+    return ok;
+  }
+
+ private:
+  void close_sockets() {
+    for (int fd : fds_)
+      close(fd);
+    fds_.clear();
+  }
+
+  vector<int> fds_;
+  vector<pid_t> pids_;
+  bool broken_;
+};
+
+
 // Solves a varient of the route inspection problem. Given a
 // connected, undirected graph with positive edge weights. Find the
 // two nodes which minimize the distance covered to visit all paths
@@ -193,21 +756,46 @@ class ShortestPaths {
 class RouteInspection {
  public:
   explicit RouteInspection(const DirectedGraph& in_graph) {
+    INSTR_SCOPED_TIMER(route_inspection_timer);
     // TODO(Jacob) Check if graph is connected
     // TODO(Jacob) Check that graph is undirected
     // TODO(Jacob) Check if edge weights are positive
     // Find number of odd degree vertices
     for (int i = 0; i < in_graph.n_nodes(); ++i) {
-      if (in_graph.out_degree(i)%2 == 1) {
+      if (in_graph.out_degree(i)%2 == 1)
         odd_nodes_.push_back(i);
-        odd_shortest_paths_.push_back(ShortestPaths(in_graph, i));
-      }
     }
     // The way we find our answer depends heavily on n_odd_nodes
     n_odd_nodes_ = odd_nodes_.size();
+    if (n_odd_nodes_ > 2) {
+      // Only the distances between odd nodes are kept
+      odd_dist_.resize(n_odd_nodes_ * n_odd_nodes_);
+      for (int i = 0; i < n_odd_nodes_; ++i) {
+        ShortestPaths paths(in_graph, odd_nodes_[i]);
+        for (int j = 0; j < n_odd_nodes_; ++j)
+          odd_dist_[i * n_odd_nodes_ + j] = paths.min_dist(odd_nodes_[j]);
+      }
+    }
+    choose_optimal_nodes();
+  }
+
+  // From the odd degree nodes and the row major distances between
+  // them, computed elsewhere, e.g. by a ShardPool
+  RouteInspection(const vector<int>& odd_nodes, const vector<int>& odd_dist)
+      : odd_nodes_(odd_nodes), odd_dist_(odd_dist),
+        n_odd_nodes_(odd_nodes.size()) {
+    INSTR_SCOPED_TIMER(route_inspection_timer);
+    choose_optimal_nodes();
+  }
+
+  pair<int, int> optimal_nodes() { return optimal_nodes_; }
+  bool is_eulerian() { return is_eulerian_; }
+
+ private:
+  void choose_optimal_nodes() {
     if (n_odd_nodes_ == 0) {
       // No odd nodes, so any two nodes are optimal
-      is_eulerian_ == true;
+      is_eulerian_ = true;
       optimal_nodes_ = std::make_pair(-1, -1);
     } else if (n_odd_nodes_ == 2) {
       // only two odd nodes, these are the optimal nodes
@@ -216,8 +804,11 @@ class RouteInspection {
     } else {
       // > 2 odd nodes. This is where it gets interesting
       is_eulerian_ = false;
-      // Find the combinations of pairs which cover every odd vertex
-      vector<pair_vector> pair_combinations = pair_comb(n_odd_nodes_);
+      // Find the combinations of pairs which cover every odd
+      // vertex. They only live until the best one is chosen.
+      arena::PhaseArena comb_arena;
+      std::pmr::vector<pair_vector> pair_combinations =
+          pair_comb(n_odd_nodes_, comb_arena.resource());
       // Find the minimum distance combination excluding one pair
       int min_dist = 999999999;
       pair<int, int> min_pair;
@@ -229,6 +820,7 @@ class RouteInspection {
 	// for this pair combination, find the distance associated
 	// with traversing the odd nodes
         cost_pair_vect(*comb_iter, &max_pair, &dist);
+        INSTR_COUNT(pairings_evaluated, 1);
 	// Keep track of the pair combination with the lowest distance
 	if (min_dist > dist) {
 	  min_dist = dist;
@@ -240,10 +832,6 @@ class RouteInspection {
     }
   }
 
-  pair<int, int> optimal_nodes() { return optimal_nodes_; }
-  bool is_eulerian() { return is_eulerian_; }
-
- private:
   // For a vector of odd node pairs, find the sum of the distances
   // between each pair, with the largest diatance pair excluded.
   // Return the pair with the largest distance.
@@ -255,8 +843,8 @@ class RouteInspection {
 	 pair_it != in_pair_vect.cend(); ++pair_it) {
       int first_node_idx = pair_it->first;
       int second_node_idx = pair_it->second;
-      int second_node = odd_nodes_[second_node_idx];
-      int cur_dist = odd_shortest_paths_[first_node_idx].min_dist(second_node);
+      int cur_dist = odd_dist_[first_node_idx * n_odd_nodes_ +
+                               second_node_idx];
       tot_dist += cur_dist;
       if (max_dist < cur_dist) {
 	max_dist = cur_dist;
@@ -268,37 +856,501 @@ class RouteInspection {
 
   vector<int> odd_nodes_;
   pair<int, int> optimal_nodes_;
-  vector<ShortestPaths> odd_shortest_paths_;
+  // Row major distances between odd nodes, by index into odd_nodes_
+  vector<int> odd_dist_;
   int n_odd_nodes_;
   bool is_eulerian_;
 };
 
 
+// Min cost flow by successive shortest paths. Each round runs
+// ShortestPaths on the residual arcs weighted by their reduced cost,
+// which the node potentials keep non-negative, then pushes flow down
+// every branch of the shortest path tree that ends at a node with
+// unmet demand. Those branches all have zero reduced cost, so one
+// round can serve many sinks.
+class MinCostFlow {
+ public:
+  explicit MinCostFlow(int n_nodes)
+      : n_nodes_(n_nodes), supply_(n_nodes, 0) {}
+
+  // Returns the id of the new arc
+  int add_arc(int from, int to, int capacity, int cost) {
+    arcs_.push_back({from, to, capacity, cost, 0});
+    arcs_.push_back({to, from, 0, -cost, 0});
+    return arcs_.size() - 2;
+  }
+
+  // Positive for nodes that send flow, negative for nodes that take it
+  void set_supply(int node, int supply) { supply_[node] = supply; }
+
+  // Meets every supply and demand at the lowest total cost. Returns
+  // false if some demand cannot be reached.
+  bool solve(long long* cost) {
+    int source = n_nodes_;
+    vector<int> need(n_nodes_ + 1, 0);
+    for (int i = 0; i < n_nodes_; ++i) {
+      if (supply_[i] > 0)
+        add_arc(source, i, supply_[i], 0);
+      else
+        need[i] = -supply_[i];
+    }
+    vector<long long> potential(n_nodes_ + 1, 0);
+    int n_unmet = std::count_if(need.cbegin(), need.cend(),
+                                [](int n) { return n > 0; });
+    while (n_unmet > 0) {
+      INSTR_COUNT(flow_rounds, 1);
+      // The residual graph only lives for one round
+      arena::PhaseArena round_arena;
+      vector<DirectedEdge> residual_edges;
+      vector<int> arc_of;
+      for (size_t a = 0; a < arcs_.size(); ++a) {
+        const Arc& arc = arcs_[a];
+        if (residual(a) <= 0)
+          continue;
+        int reduced = arc.cost + potential[arc.from] - potential[arc.to];
+        residual_edges.push_back({reduced, arc.from, arc.to});
+        arc_of.push_back(a);
+      }
+      DirectedGraph residual_graph(n_nodes_ + 1, residual_edges,
+                                   round_arena.resource());
+      ShortestPaths paths(residual_graph, source);
+
+      // Unreached nodes move by the largest distance so that arcs
+      // from them into the tree keep a non-negative reduced cost
+      int max_dist = 0;
+      for (int i = 0; i <= n_nodes_; ++i) {
+        if (paths.has_path_to(i))
+          max_dist = std::max(max_dist, paths.min_dist(i));
+      }
+      for (int i = 0; i <= n_nodes_; ++i)
+        potential[i] += paths.has_path_to(i) ? paths.min_dist(i) : max_dist;
+
+      bool pushed = false;
+      for (int sink = 0; sink < n_nodes_; ++sink) {
+        if (need[sink] == 0 || !paths.has_path_to(sink))
+          continue;
+        int amount = need[sink];
+        for (int node = sink; node != source;
+             node = residual_edges[paths.edge_to(node)].from)
+          amount = std::min(amount, residual(arc_of[paths.edge_to(node)]));
+        if (amount == 0)
+          continue;
+        for (int node = sink; node != source;
+             node = residual_edges[paths.edge_to(node)].from)
+          push(arc_of[paths.edge_to(node)], amount);
+        INSTR_COUNT(flow_augmentations, 1);
+        need[sink] -= amount;
+        n_unmet -= need[sink] == 0;
+        pushed = true;
+      }
+      if (!pushed)
+        return false;
+    }
+    *cost = 0;
+    for (size_t a = 0; a < arcs_.size(); a += 2)
+      *cost += static_cast<long long>(arcs_[a].flow) * arcs_[a].cost;
+    return true;
+  }
+
+  int flow(int arc) const { return arcs_[arc].flow; }
+
+ private:
+  // Arc 2k is added by add_arc and arc 2k+1 is its reverse
+  struct Arc {
+    int from;
+    int to;
+    int capacity;
+    int cost;
+    int flow;
+  };
+
+  int residual(int arc) const {
+    return arcs_[arc].capacity - arcs_[arc].flow;
+  }
+  void push(int arc, int amount) {
+    arcs_[arc].flow += amount;
+    arcs_[arc ^ 1].flow -= amount;
+  }
+
+  int n_nodes_;
+  vector<int> supply_;
+  vector<Arc> arcs_;
+};
+
+// True if every node with an edge can reach, and be reached from,
+// every other such node
+bool strongly_connected(const DirectedGraph& in_graph) {
+  int n_nodes = in_graph.n_nodes();
+  vector<DirectedEdge> edges = in_graph.edges();
+  vector<DirectedEdge> reversed;
+  vector<bool> has_edge(n_nodes, false);
+  for (auto edge_it = edges.cbegin(); edge_it < edges.cend(); ++edge_it) {
+    reversed.push_back({edge_it->weight, edge_it->to, edge_it->from});
+    has_edge[edge_it->from] = has_edge[edge_it->to] = true;
+  }
+  if (edges.empty())
+    return true;
+  DirectedGraph reverse_graph(n_nodes, reversed);
+  const DirectedGraph* graphs[] = {&in_graph, &reverse_graph};
+  for (const DirectedGraph* graph : graphs) {
+    vector<bool> seen(n_nodes, false);
+    vector<int> stack = {edges[0].from};
+    seen[edges[0].from] = true;
+    while (!stack.empty()) {
+      int node = stack.back();
+      stack.pop_back();
+      for (int idx : graph->adj_indices(node)) {
+        int next = graph->edge(idx).to;
+        if (!seen[next]) {
+          seen[next] = true;
+          stack.push_back(next);
+        }
+      }
+    }
+    for (int i = 0; i < n_nodes; ++i) {
+      if (has_edge[i] && !seen[i])
+        return false;
+    }
+  }
+  return true;
+}
+
+// Route inspection for one-way trails (the directed Chinese postman
+// problem). A closed tour has to leave every node as often as it
+// enters it, so each node with more edges in than out is joined to
+// nodes with more out than in by walking extra copies of edges. The
+// cheapest set of copies is a min cost flow from the first kind of
+// node to the second. A two-way trail is two edges here and is walked
+// once in each direction.
+class DirectedPostman {
+ public:
+  explicit DirectedPostman(const DirectedGraph& in_graph)
+      : duplications_(in_graph.n_edges(), 0), tour_cost_(0),
+        feasible_(false) {
+    INSTR_SCOPED_TIMER(directed_postman_timer);
+    int n_nodes = in_graph.n_nodes();
+    vector<DirectedEdge> edges = in_graph.edges();
+    vector<int> balance(n_nodes, 0);
+    int total_imbalance = 0;
+    for (auto edge_it = edges.cbegin(); edge_it < edges.cend(); ++edge_it) {
+      tour_cost_ += edge_it->weight;
+      ++balance[edge_it->to];
+      --balance[edge_it->from];
+    }
+    if (!strongly_connected(in_graph))
+      return;
+    for (int i = 0; i < n_nodes; ++i)
+      total_imbalance += std::max(0, balance[i]);
+    MinCostFlow flow(n_nodes);
+    vector<int> arc_ids;
+    for (auto edge_it = edges.cbegin(); edge_it < edges.cend(); ++edge_it) {
+      arc_ids.push_back(flow.add_arc(edge_it->from, edge_it->to,
+                                     total_imbalance, edge_it->weight));
+    }
+    for (int i = 0; i < n_nodes; ++i)
+      flow.set_supply(i, balance[i]);
+    long long extra_cost;
+    feasible_ = flow.solve(&extra_cost);
+    if (!feasible_)
+      return;
+    tour_cost_ += extra_cost;
+    for (size_t i = 0; i < arc_ids.size(); ++i)
+      duplications_[i] = flow.flow(arc_ids[i]);
+  }
+
+  // False if no closed tour covers every edge
+  bool feasible() const { return feasible_; }
+  // Total weight of the shortest closed tour over every edge
+  long long tour_cost() const { return tour_cost_; }
+  // Extra times each edge of the graph is walked, by edge index
+  const vector<int>& duplications() const { return duplications_; }
+
+ private:
+  vector<int> duplications_;
+  long long tour_cost_;
+  bool feasible_;
+};
+
+void print_postman(const DirectedGraph& graph,
+                   const DirectedPostman& postman, string* out) {
+  if (!postman.feasible()) {
+    appendf(out, "No closed tour covers every one-way trail\n\n");
+    return;
+  }
+  appendf(out, "Tour cost: %lld\n", postman.tour_cost());
+  vector<DirectedEdge> edges = graph.edges();
+  for (size_t i = 0; i < edges.size(); ++i) {
+    if (postman.duplications()[i] > 0) {
+      appendf(out, "Walk again: %c -> %c x%d\n", edges[i].from + 'A',
+              edges[i].to + 'A', postman.duplications()[i]);
+    }
+  }
+  appendf(out, "\n");
+}
+
+void print_route(RouteInspection* route, string* out) {
+  pair<int, int> optimal_nodes = route->optimal_nodes();
+  appendf(out, "Is Eulerian: %s\n",
+          route->is_eulerian() ? "True" : "False");
+  appendf(out, "Optimal Nodes: %c, %c\n\n",
+          optimal_nodes.first + 'A', optimal_nodes.second + 'A');
+}
+
+// Solves the park read from in_file and appends the report to out
+void solve_park(const string& file_name, std::istream* in_file,
+                string* out) {
+  // Everything built for this file is released together
+  arena::PhaseArena graph_arena;
+  DirectedGraph cur_graph(in_file, graph_arena.resource());
+
+  appendf(out, "File: %s\n", file_name.c_str());
+  appendf(out, "Number of nodes: %d\n", cur_graph.n_nodes());
+  appendf(out, "Graph\n%s\n", cur_graph.to_string().c_str());
+
+  // The pairing of odd nodes below only holds for two-way trails
+  if (!cur_graph.is_symmetric()) {
+    appendf(out, "One-way trails\n");
+    print_postman(cur_graph, DirectedPostman(cur_graph), out);
+    return;
+  }
+  RouteInspection cur_route(cur_graph);
+  print_route(&cur_route, out);
+}
+
+// Mixes the bits of x (splitmix64 finalizer)
+inline uint64_t mix_bits(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+inline uint64_t edge_hash(int from, int to, int weight) {
+  return mix_bits((static_cast<uint64_t>(from) << 32 |
+                   static_cast<uint32_t>(to)) ^
+                  mix_bits(static_cast<uint64_t>(weight)));
+}
+
+// Solves the park in in_file like solve_park, with the distances
+// between odd nodes computed by the shard workers, which read their
+// own rows of the file. This process never holds the graph: one pass
+// over the matrix collects the degrees, the largest weight and a
+// symmetry check, and a second pass prints the graph as it streams
+// by. The check compares order independent hashes of every edge and
+// of its reverse, which only a one in 2^64 collision can fool.
+// One-way parks need the whole graph for the postman and go through
+// solve_park instead. Returns false if the workers failed.
+bool solve_park_sharded(const string& file_name, std::istream* in_file,
+                        ShardPool* pool) {
+  int n_nodes = read_matrix_size(in_file);
+  vector<int> degree(n_nodes, 0);
+  int max_weight = 0;
+  uint64_t forward_hash = 0;
+  uint64_t backward_hash = 0;
+  for_each_matrix_edge(in_file, n_nodes, 0, std::numeric_limits<int>::max(),
+                       [&](const DirectedEdge& edge) {
+                         ++degree[edge.from];
+                         max_weight = std::max(max_weight, edge.weight);
+                         forward_hash += edge_hash(edge.from, edge.to,
+                                                   edge.weight);
+                         backward_hash += edge_hash(edge.to, edge.from,
+                                                    edge.weight);
+                       });
+  in_file->clear();
+  in_file->seekg(0);
+  if (forward_hash != backward_hash) {
+    string report;
+    solve_park(file_name, in_file, &report);
+    fputs(report.c_str(), stdout);
+    return true;
+  }
+
+  // Same layout as DirectedGraph::to_string, one row at a time
+  printf("File: %s\n", file_name.c_str());
+  printf("Number of nodes: %d\nGraph\n", n_nodes);
+  read_matrix_size(in_file);
+  int printed_rows = 0;
+  string row_text;
+  auto finish_rows = [&](int end_row) {
+    for (; printed_rows < end_row; ++printed_rows) {
+      printf("From: %d To: %s\n", printed_rows, row_text.c_str());
+      row_text.clear();
+    }
+  };
+  for_each_matrix_edge(in_file, n_nodes, 0, std::numeric_limits<int>::max(),
+                       [&](const DirectedEdge& edge) {
+                         finish_rows(edge.from);
+                         row_text += std::to_string(edge.to) + ":" +
+                             std::to_string(edge.weight) + ", ";
+                       });
+  finish_rows(n_nodes);
+  printf("\n");
+
+  vector<int> odd_nodes;
+  for (int i = 0; i < n_nodes; ++i) {
+    if (degree[i]%2 == 1)
+      odd_nodes.push_back(i);
+  }
+  vector<int> odd_dist;
+  if (odd_nodes.size() > 2) {
+    ShardSpec spec = {kMatrixFile, n_nodes, 0, file_name};
+    if (!pool->distances(spec, max_weight, odd_nodes, &odd_dist)) {
+      printf("Shard workers failed on %s\n", file_name.c_str());
+      return false;
+    }
+  }
+  RouteInspection cur_route(odd_nodes, odd_dist);
+  string report;
+  print_route(&cur_route, &report);
+  fputs(report.c_str(), stdout);
+  return true;
+}
+
+// Times the directed postman on a random one-way network: a ring
+// through every node, to keep it strongly connected, plus n_extra
+// random one-way edges. Checks that the plan balances every node and
+// that the reported cost matches the plan.
+int run_postman_bench(int n_nodes, int n_extra) {
+  std::mt19937 gen(47);
+  std::uniform_int_distribution<int> node(0, n_nodes - 1);
+  std::uniform_int_distribution<int> weight(1, 100);
+  vector<DirectedEdge> edges;
+  for (int i = 0; i < n_nodes; ++i)
+    edges.push_back({weight(gen), i, (i + 1) % n_nodes});
+  for (int i = 0; i < n_extra; ++i) {
+    int from = node(gen);
+    int to = node(gen);
+    if (from != to)
+      edges.push_back({weight(gen), from, to});
+  }
+  DirectedGraph graph(n_nodes, edges);
+  auto start = std::chrono::steady_clock::now();
+  DirectedPostman postman(graph);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  vector<long long> balance(n_nodes, 0);
+  long long plan_cost = 0;
+  long long n_duplicated = 0;
+  for (size_t i = 0; i < edges.size(); ++i) {
+    int times = 1 + postman.duplications()[i];
+    balance[edges[i].to] += times;
+    balance[edges[i].from] -= times;
+    plan_cost += static_cast<long long>(times) * edges[i].weight;
+    n_duplicated += postman.duplications()[i];
+  }
+  bool balanced = std::all_of(balance.cbegin(), balance.cend(),
+                              [](long long b) { return b == 0; });
+  printf("Nodes: %d\tEdges: %zu\n", n_nodes, edges.size());
+  printf("Tour cost: %lld\tExtra edge walks: %lld\n",
+         postman.tour_cost(), n_duplicated);
+  printf("Solve: %f s\n", elapsed.count());
+  printf("Balanced: %s\tCost matches plan: %s\n",
+         balanced ? "True" : "False",
+         plan_cost == postman.tour_cost() ? "True" : "False");
+  return postman.feasible() && balanced &&
+      plan_cost == postman.tour_cost() ? 0 : -1;
+}
+
+// Times the shard workers on the random two-way network of
+// visit_bench_trails. The workers regenerate their own part of it;
+// this process builds the whole graph only for the check. The first
+// n_sources odd nodes are the sources. Checks the matrix against one
+// ShortestPaths per source.
+int run_shard_bench(int n_nodes, int n_extra, int n_sources,
+                    ShardPool* pool) {
+  vector<DirectedEdge> edges;
+  visit_bench_trails(n_nodes, n_extra, [&](const DirectedEdge& edge) {
+    edges.push_back(edge);
+  });
+  DirectedGraph graph(n_nodes, edges);
+  vector<int> sources;
+  for (int i = 0; i < n_nodes && static_cast<int>(sources.size()) < n_sources;
+       ++i) {
+    if (graph.out_degree(i)%2 == 1)
+      sources.push_back(i);
+  }
+  int k = sources.size();
+  int max_weight = 0;
+  for (const auto& edge : edges)
+    max_weight = std::max(max_weight, edge.weight);
+
+  auto start = std::chrono::steady_clock::now();
+  vector<int> single(static_cast<size_t>(k) * k);
+  for (int i = 0; i < k; ++i) {
+    ShortestPaths paths(graph, sources[i]);
+    for (int j = 0; j < k; ++j)
+      single[static_cast<size_t>(i) * k + j] = paths.min_dist(sources[j]);
+  }
+  std::chrono::duration<double> single_elapsed =
+      std::chrono::steady_clock::now() - start;
+  int n_shards = pool->size();
+  start = std::chrono::steady_clock::now();
+  vector<int> sharded;
+  ShardSpec spec = {kTrailBench, n_nodes, n_extra, ""};
+  if (!pool->distances(spec, max_weight, sources, &sharded)) {
+    printf("Shard workers failed\n");
+    return -1;
+  }
+  std::chrono::duration<double> sharded_elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printf("Nodes: %d\tEdges: %zu\tSources: %d\tShards: %d\n",
+         n_nodes, edges.size(), k, n_shards);
+  printf("Single process: %f s\n", single_elapsed.count());
+  printf("Sharded: %f s\n", sharded_elapsed.count());
+  printf("Matches single process: %s\n",
+         single == sharded ? "True" : "False");
+  return single == sharded ? 0 : -1;
+}
+
+// Usage: park_ranger [--shards n_workers]
+//        park_ranger --directed matrix_file
+//        park_ranger --batch directory_or_glob
+//        park_ranger --postman-bench n_nodes n_extra_edges
+//        park_ranger --shard-bench n_nodes n_extra_edges n_sources n_workers
 int main(int argc, char *argv[]) {
+  // Shard workers are forked before the instrumentation thread, or any
+  // other, starts
+  std::unique_ptr<ShardPool> pool;
+  if (argc == 6 && string(argv[1]) == "--shard-bench")
+    pool.reset(new ShardPool(std::max(1, std::atoi(argv[5]))));
+  if (argc == 3 && string(argv[1]) == "--shards" && std::atoi(argv[2]) > 1)
+    pool.reset(new ShardPool(std::atoi(argv[2])));
+  INSTR_INSTALL_DUMP("park_ranger");
+  if (argc == 3 && string(argv[1]) == "--batch") {
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+    return run_batch_files(argv[2], n_threads,
+                           [](const string& file_name, const string& contents,
+                              string* out) {
+                             std::istringstream in_file(contents);
+                             solve_park(file_name, &in_file, out);
+                           });
+  }
+  if (argc == 4 && string(argv[1]) == "--postman-bench")
+    return run_postman_bench(std::max(2, std::atoi(argv[2])),
+                             std::max(0, std::atoi(argv[3])));
+  if (argc == 6 && string(argv[1]) == "--shard-bench")
+    return run_shard_bench(std::max(2, std::atoi(argv[2])),
+                           std::max(0, std::atoi(argv[3])),
+                           std::max(1, std::atoi(argv[4])), pool.get());
   vector<string> file_strings = {kInputFile1,
                                  kInputFile2,
                                  kInputFile3};
+  if (argc == 3 && string(argv[1]) == "--directed")
+    file_strings = {argv[2]};
+  bool ok = true;
   for (auto iter = file_strings.cbegin();
        iter < file_strings.cend(); ++iter) {
     std::ifstream in_file(*iter);
-    if (in_file) {
-      DirectedGraph cur_graph(&in_file);
-
-      printf("File: %s\n", iter->c_str());
-      printf("Number of nodes: %d\n", cur_graph.n_nodes());
-      string print_string = cur_graph.to_string();
-      printf("Graph\n%s\n", print_string.c_str());
-
-      RouteInspection cur_route(cur_graph);
-      bool is_eulerian = cur_route.is_eulerian();
-      pair<int, int> optimal_nodes = cur_route.optimal_nodes();
-      
-      printf("Is Eulerian: %s\n", cur_route.is_eulerian() ? "True" : "False");
-      printf("Optimal Nodes: %c, %c\n\n",
-             optimal_nodes.first + 'A', optimal_nodes.second + 'A');
-      
+    if (in_file && pool) {
+      ok = solve_park_sharded(*iter, &in_file, pool.get()) && ok;
+    } else if (in_file) {
+      string report;
+      solve_park(*iter, &in_file, &report);
+      fputs(report.c_str(), stdout);
     }
     in_file.close();
   }
-  return 0;
+  return ok ? 0 : -1;
 }
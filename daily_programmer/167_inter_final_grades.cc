@@ -1,132 +1,1089 @@
-
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 
-#include <fstream>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <thread>
 #include <vector>
 
+#include "buffered_writer.h"
+#include "mapped_file.h"
+#include "../common/arena.h"
+#include "../common/instrumentation.h"
+
 using std::string;
+using std::string_view;
 using std::vector;
 using std::pair;
 
 static char input_file_name[] = "test_scores.txt";
 static char output_file_name[] = "report_card.txt";
-static int kNumTests = 5;
 
+INSTR_COUNTER(rows_parsed, "grades_rows_parsed");
+INSTR_COUNTER(rows_written, "grades_rows_written");
+INSTR_TIMER(parse_timer, "grades_parse");
+INSTR_COUNTER(score_events, "grades_online_score_events");
+INSTR_COUNTER(snapshots_written, "grades_online_snapshots");
+INSTR_TIMER(report_timer, "grades_report");
+
+// One student's row as parsed, or as kept by the online book. Names
+// point into the parsed line or the book's arena, and the scores live
+// in whatever vector the row was parsed into.
 struct GradeHistory {
-  string first_name;
-  string last_name;
-  vector<int> test_grades;
+  string_view first_name;
+  string_view last_name;
+  size_t grades_begin;
+  int n_grades;
   int average;
-  string letter_grade;
+  const char* letter_grade;
 };
 
-double mean(const std::vector<int>& numbers) {
-    if (numbers.empty())
-        return 0;
-    int sum = std::accumulate(numbers.cbegin(), numbers.cend(), 0);
-    return static_cast<double>(sum) / numbers.size();
-}
-
+// Letter grades in the order assign_letter_grade hands them out
+static const char* kLetterGrades[] = {"F", "D-", "D", "D+", "C-", "C", "C+",
+                                      "B-", "B", "B+", "A-", "A"};
+static const int kNumLetterGrades = 12;
+static const int kMaxScore = 100;
 
-string assign_letter_grade(int score) {
+const char* assign_letter_grade(int score) {
   if (score < 60) {
-    return string("F");
+    return "F";
   } else if (score < 63) {
-    return string("D-");
+    return "D-";
   } else if (score < 67) {
-    return string("D");
+    return "D";
   } else if (score < 70) {
-    return string("D+");
+    return "D+";
   } else if (score < 73) {
-    return string("C-");
+    return "C-";
   } else if (score < 77) {
-    return string("C");
+    return "C";
   } else if (score < 80) {
-    return string("C+");
+    return "C+";
   } else if (score < 83) {
-    return string("B-");
+    return "B-";
   } else if (score < 87) {
-    return string("B");
+    return "B";
   } else if (score < 90) {
-    return string("B+");
+    return "B+";
   } else if (score < 93) {
-    return string("A-");
+    return "A-";
   } else if (score <= 100) {
-    return string("A");
+    return "A";
   } else {
     printf("Error, grade outside of range");
+    return "?";
   }
 }
 
 
-void parse_input_file(string file_name, vector<GradeHistory>* histories) {
-  char name_delim = ',';
-  char score_delim = '\t';
-  std::ifstream in_file(file_name);
-  if (!in_file.is_open()) {
-    printf("File could not be opened\n");
+// Parses one "First,Last\tscore\tscore..." line in [begin, end). Any
+// number of scores is accepted. Returns false for lines without a name.
+bool parse_line(const char* begin, const char* end,
+                vector<int>* grades, GradeHistory* history) {
+  const char* name_delim = static_cast<const char*>(
+      memchr(begin, ',', end - begin));
+  if (name_delim == nullptr)
+    return false;
+  const char* cur = name_delim + 1;
+  while (cur < end && *cur != '\t')
+    ++cur;
+  history->first_name = string_view(begin, name_delim - begin);
+  history->last_name = string_view(name_delim + 1, cur - name_delim - 1);
+  history->grades_begin = grades->size();
+  // Hand rolled integer parsing, scores are separated by whitespace
+  while (cur < end) {
+    while (cur < end && (*cur == '\t' || *cur == ' ' || *cur == '\r'))
+      ++cur;
+    if (cur == end || *cur < '0' || *cur > '9')
+      break;
+    int value = 0;
+    while (cur < end && *cur >= '0' && *cur <= '9') {
+      // Stops growing once past any valid score, so it cannot overflow
+      if (value <= kMaxScore)
+        value = value * 10 + (*cur - '0');
+      ++cur;
+    }
+    grades->push_back(value);
+  }
+  history->n_grades = grades->size() - history->grades_begin;
+  return true;
+}
+
+
+// One chunk of students as parsed, before it is placed in the columns.
+// Names are ids into the chunk's own dictionary, whose views point
+// into the input, and each row's scores are stored sorted, row major.
+struct ParsedRows {
+  vector<string_view> names;
+  std::unordered_map<string_view, uint32_t> name_ids;
+  vector<uint32_t> first_name_ids;
+  vector<uint32_t> last_name_ids;
+  vector<uint32_t> n_grades;
+  vector<uint8_t> scores;
+  int n_tests = 0;
+  size_t n_rejected = 0;
+};
+
+uint32_t intern_name(string_view name, ParsedRows* rows) {
+  auto found = rows->name_ids.find(name);
+  if (found != rows->name_ids.end())
+    return found->second;
+  uint32_t id = rows->names.size();
+  rows->names.push_back(name);
+  rows->name_ids.emplace(name, id);
+  return id;
+}
+
+// Adds a student to rows, sorting grades in place. A row with a score
+// above kMaxScore is counted as rejected instead of being added.
+void add_row(string_view first_name, string_view last_name, int* grades,
+             int n_grades, ParsedRows* rows) {
+  if (std::any_of(grades, grades + n_grades,
+                  [](int grade) { return grade > kMaxScore; })) {
+    ++rows->n_rejected;
     return;
   }
-  string str;
-  while (std::getline(in_file, str)) {
+  // Sort scores in ascending order
+  std::sort(grades, grades + n_grades);
+  rows->first_name_ids.push_back(intern_name(first_name, rows));
+  rows->last_name_ids.push_back(intern_name(last_name, rows));
+  rows->n_grades.push_back(n_grades);
+  rows->scores.insert(rows->scores.end(), grades, grades + n_grades);
+  rows->n_tests = std::max(rows->n_tests, n_grades);
+}
+
+
+// Parses every line in [begin, end) into rows.
+void parse_chunk(const char* begin, const char* end, ParsedRows* rows) {
+  // Reserve for every line scoring like the first, so a uniform file
+  // never reallocates
+  size_t n_lines = std::count(begin, end, '\n') + 1;
+  rows->first_name_ids.reserve(n_lines);
+  rows->last_name_ids.reserve(n_lines);
+  rows->n_grades.reserve(n_lines);
+  vector<int> grades;
+  const char* cur = begin;
+  while (cur < end) {
+    const char* line_end = static_cast<const char*>(
+        memchr(cur, '\n', end - cur));
+    if (line_end == nullptr)
+      line_end = end;
     GradeHistory cur_history;
-    // Get First and last names
-    size_t name_delim_loc = str.find(name_delim);
-    size_t score_delim_loc = str.find(score_delim, name_delim_loc);
-    cur_history.first_name = str.substr(0, name_delim_loc);
-    cur_history.last_name = str.substr(name_delim_loc+1,
-                                       score_delim_loc-name_delim_loc);
-    // Get all the test scores
-    size_t score_start = score_delim_loc+1;
-    string score_string;
-    for (int i = 0; i < kNumTests-1; i++) {
-      size_t score_end = str.find(score_delim, score_start);
-      score_string = str.substr(score_start,
-                                score_end - score_start);
-      cur_history.test_grades.push_back(std::atoi(score_string.c_str()));
-      score_start = score_end + 1;
+    grades.clear();
+    if (parse_line(cur, line_end, &grades, &cur_history)) {
+      if (rows->scores.empty())
+        rows->scores.reserve(grades.size() * n_lines);
+      add_row(cur_history.first_name, cur_history.last_name, grades.data(),
+              grades.size(), rows);
+    }
+    cur = line_end + 1;
+  }
+  INSTR_COUNT(rows_parsed, rows->n_grades.size());
+}
+
+
+// Splits [data, data+size) into at most n_chunks pieces which all end
+// on a newline so that no line straddles two chunks.
+vector<pair<const char*, const char*>> split_at_newlines(const char* data,
+                                                         size_t size,
+                                                         int n_chunks) {
+  vector<pair<const char*, const char*>> chunks;
+  const char* file_end = data + size;
+  const char* cur = data;
+  for (int i = 1; i <= n_chunks && cur < file_end; ++i) {
+    const char* chunk_end = data + size * i / n_chunks;
+    if (chunk_end < cur)
+      chunk_end = cur;
+    const char* newline = static_cast<const char*>(
+        memchr(chunk_end, '\n', file_end - chunk_end));
+    chunk_end = (newline == nullptr) ? file_end : newline + 1;
+    chunks.push_back(std::make_pair(cur, chunk_end));
+    cur = chunk_end;
+  }
+  return chunks;
+}
+
+
+
+// Struct-of-arrays grade book. Names are interned into one pool,
+// scores are a column-major uint8 matrix (column j holds the j-th
+// lowest score of every student) and averages and letters are one
+// byte each. Column-major storage lets the statistic kernels run over
+// whole columns, which the compiler turns into packed byte and add
+// instructions. Built straight from the parsed chunks, so the book
+// never exists in a wider form.
+class GradeColumns {
+ public:
+  GradeColumns() : n_students_(0), n_tests_(0) {}
+
+  // Merges the chunks in order, one thread per chunk, releasing each
+  // chunk once it is placed
+  explicit GradeColumns(vector<ParsedRows>* chunks) {
+    int n_chunks = chunks->size();
+    n_students_ = 0;
+    n_tests_ = 0;
+    vector<size_t> row_offsets(n_chunks + 1, 0);
+    for (int c = 0; c < n_chunks; ++c) {
+      const ParsedRows& rows = (*chunks)[c];
+      row_offsets[c+1] = row_offsets[c] + rows.n_grades.size();
+      n_tests_ = std::max(n_tests_, rows.n_tests);
+    }
+    n_students_ = row_offsets[n_chunks];
+    // Chunk dictionaries are small, so they are merged serially
+    std::unordered_map<string_view, uint32_t> merged_ids;
+    vector<vector<uint32_t>> global_ids(n_chunks);
+    for (int c = 0; c < n_chunks; ++c) {
+      for (string_view name : (*chunks)[c].names) {
+        auto found = merged_ids.emplace(name, name_offsets_.size());
+        if (found.second) {
+          name_offsets_.push_back(name_pool_.size());
+          name_pool_.append(name);
+        }
+        global_ids[c].push_back(found.first->second);
+      }
+    }
+    // Ids only, so the table stays valid when the pool moves
+    size_t n_slots = 1;
+    while (n_slots < 2 * name_offsets_.size())
+      n_slots *= 2;
+    name_slots_.assign(n_slots, kNoName);
+    for (uint32_t id = 0; id < name_offsets_.size(); ++id) {
+      size_t slot = std::hash<string_view>()(name(id)) & (n_slots - 1);
+      while (name_slots_[slot] != kNoName)
+        slot = (slot + 1) & (n_slots - 1);
+      name_slots_[slot] = id;
+    }
+
+    first_name_ids_.resize(n_students_);
+    last_name_ids_.resize(n_students_);
+    n_grades_.resize(n_students_);
+    // Missing scores are padded high, past the end of a sorted row
+    scores_.assign(static_cast<size_t>(n_tests_) * n_students_, 0xff);
+    vector<std::thread> workers;
+    for (int c = 0; c < n_chunks; ++c) {
+      workers.emplace_back([&, c]() {
+        ParsedRows& rows = (*chunks)[c];
+        size_t score_pos = 0;
+        for (size_t r = 0; r < rows.n_grades.size(); ++r) {
+          size_t s = row_offsets[c] + r;
+          first_name_ids_[s] = global_ids[c][rows.first_name_ids[r]];
+          last_name_ids_[s] = global_ids[c][rows.last_name_ids[r]];
+          n_grades_[s] = rows.n_grades[r];
+          for (uint32_t j = 0; j < rows.n_grades[r]; ++j)
+            scores_[j * n_students_ + s] = rows.scores[score_pos++];
+        }
+        rows = ParsedRows();
+      });
+    }
+    for (auto& worker : workers)
+      worker.join();
+    calc_averages();
+  }
+
+  size_t n_students() const { return n_students_; }
+  int n_tests() const { return n_tests_; }
+  int n_grades(size_t student) const { return n_grades_[student]; }
+  uint8_t score(size_t student, int test) const {
+    return scores_[test * n_students_ + student];
+  }
+  int average(size_t student) const { return averages_[student]; }
+  const char* letter_grade(size_t student) const {
+    return kLetterGrades[letters_[student]];
+  }
+  string_view first_name(size_t student) const {
+    return name(first_name_ids_[student]);
+  }
+  string_view last_name(size_t student) const {
+    return name(last_name_ids_[student]);
+  }
+
+  // Every student with exactly this name. The names are looked up in
+  // the pool's dictionary, so only the id columns are scanned.
+  vector<uint32_t> find(string_view first_name,
+                        string_view last_name) const {
+    vector<uint32_t> students;
+    uint32_t first_id = name_id(first_name);
+    uint32_t last_id = name_id(last_name);
+    if (first_id == kNoName || last_id == kNoName)
+      return students;
+    for (size_t s = 0; s < n_students_; ++s) {
+      if (first_name_ids_[s] == first_id && last_name_ids_[s] == last_id)
+        students.push_back(s);
+    }
+    return students;
+  }
+
+  // Number of students with each average, indexed 0 to kMaxScore
+  vector<size_t> histogram() const {
+    vector<size_t> counts(kMaxScore + 1, 0);
+    for (uint8_t avg : averages_)
+      ++counts[avg];
+    return counts;
+  }
+
+  // Smallest average such that at least pct percent of the class is at
+  // or below it. Read off the cumulative histogram, so no sort is needed.
+  int percentile(double pct) const {
+    vector<size_t> counts = histogram();
+    size_t target = std::ceil(pct / 100.0 * n_students_);
+    size_t seen = 0;
+    for (int avg = 0; avg <= kMaxScore; ++avg) {
+      seen += counts[avg];
+      if (seen >= target && seen > 0)
+        return avg;
+    }
+    return kMaxScore;
+  }
+
+  double class_mean() const {
+    if (n_students_ == 0)
+      return 0;
+    uint64_t sum = 0;
+    for (uint8_t avg : averages_)
+      sum += avg;
+    return static_cast<double>(sum) / n_students_;
+  }
+
+  size_t memory_bytes() const {
+    return name_pool_.capacity() + name_offsets_.capacity() * 4 +
+        name_slots_.capacity() * 4 +
+        (first_name_ids_.capacity() + last_name_ids_.capacity()) * 4 +
+        scores_.capacity() + n_grades_.capacity() * 4 +
+        averages_.capacity() + letters_.capacity();
+  }
+
+ private:
+  static constexpr uint32_t kNoName = UINT32_MAX;
+
+  string_view name(uint32_t id) const {
+    uint32_t begin = name_offsets_[id];
+    uint32_t end = (id + 1 < name_offsets_.size()) ?
+        name_offsets_[id+1] : name_pool_.size();
+    return string_view(name_pool_.data() + begin, end - begin);
+  }
+
+  uint32_t name_id(string_view key) const {
+    if (name_slots_.empty())
+      return kNoName;
+    size_t mask = name_slots_.size() - 1;
+    size_t slot = std::hash<string_view>()(key) & mask;
+    while (name_slots_[slot] != kNoName && name(name_slots_[slot]) != key)
+      slot = (slot + 1) & mask;
+    return name_slots_[slot];
+  }
+
+  void calc_averages() {
+    uint8_t letter_lookup[kMaxScore + 1];
+    for (int avg = 0; avg <= kMaxScore; ++avg) {
+      const char* letter = assign_letter_grade(avg);
+      for (int l = 0; l < kNumLetterGrades; ++l) {
+        if (strcmp(letter, kLetterGrades[l]) == 0)
+          letter_lookup[avg] = l;
+      }
+    }
+    vector<uint64_t> sums(n_students_, 0);
+    for (int j = 0; j < n_tests_; ++j) {
+      const uint8_t* column = scores_.data() + j * n_students_;
+      for (size_t s = 0; s < n_students_; ++s)
+        sums[s] += (static_cast<uint32_t>(j) < n_grades_[s]) ? column[s] : 0;
+    }
+    averages_.resize(n_students_);
+    letters_.resize(n_students_);
+    for (size_t s = 0; s < n_students_; ++s) {
+      uint64_t n = std::max<uint64_t>(n_grades_[s], 1);
+      // Integer form of std::round(sum / n) for non-negative sums
+      averages_[s] = (2 * sums[s] + n) / (2 * n);
+      letters_[s] = letter_lookup[averages_[s]];
     }
-    score_string = str.substr(score_start);
-    cur_history.test_grades.push_back(std::atoi(score_string.c_str()));
-    // Sort scores in ascending order
-    std::sort(cur_history.test_grades.begin(), cur_history.test_grades.end());
-    cur_history.average = std::round(mean(cur_history.test_grades));
-    // Assign letter grade
-    cur_history.letter_grade = assign_letter_grade(cur_history.average);
-    histories->push_back(cur_history);
   }
+
+  string name_pool_;
+  vector<uint32_t> name_offsets_;
+  // Open-addressed table of name ids, hashed by the pooled name
+  vector<uint32_t> name_slots_;
+  vector<uint32_t> first_name_ids_;
+  vector<uint32_t> last_name_ids_;
+  vector<uint8_t> scores_;
+  vector<uint32_t> n_grades_;
+  vector<uint8_t> averages_;
+  vector<uint8_t> letters_;
+  size_t n_students_;
+  int n_tests_;
+};
+
+
+// Parses the mapped file on n_threads workers, each into its own
+// chunk, which the columns then take over in parallel. Rows with a
+// score above kMaxScore are skipped and reported.
+void parse_input_file(const string& file_name, int n_threads,
+                      GradeColumns* columns) {
+  INSTR_SCOPED_TIMER(parse_timer);
+  MappedFile file(file_name);
+  if (!file.is_open()) {
+    printf("File could not be opened\n");
+    return;
+  }
+  auto chunks = split_at_newlines(file.data(), file.size(), n_threads);
+  int n_chunks = chunks.size();
+  vector<ParsedRows> chunk_rows(n_chunks);
+  vector<std::thread> workers;
+  for (int i = 0; i < n_chunks; ++i) {
+    workers.emplace_back(parse_chunk, chunks[i].first, chunks[i].second,
+                         &chunk_rows[i]);
+  }
+  for (auto& worker : workers)
+    worker.join();
+  size_t n_rejected = 0;
+  for (const auto& rows : chunk_rows)
+    n_rejected += rows.n_rejected;
+  if (n_rejected > 0)
+    printf("Skipped %zu rows with scores above %d\n", n_rejected, kMaxScore);
+  *columns = GradeColumns(&chunk_rows);
 }
 
 
-void save_report_card(string file_name, const vector<GradeHistory>& histories) {
-  std::ofstream out_file(file_name);
-  for (auto iter_ = histories.cbegin();
-       iter_ != histories.cend(); ++iter_) {
-    out_file << iter_->first_name << ","
-             << iter_->last_name << "\t("
-             << iter_->average << "%)\t("
-             << iter_->letter_grade << "):";
-    for (int i = 0; i < kNumTests; ++i)
-      out_file << '\t' << iter_->test_grades[i];
-    out_file << std::endl;
+void print_class_stats(const GradeColumns& columns) {
+  printf("Students: %zu\n", columns.n_students());
+  printf("Bytes per student: %.1f\n",
+         static_cast<double>(columns.memory_bytes()) /
+         std::max<size_t>(columns.n_students(), 1));
+  printf("Class mean: %.2f\n", columns.class_mean());
+  printf("Percentiles: 10th %d, 50th %d, 90th %d\n",
+         columns.percentile(10), columns.percentile(50),
+         columns.percentile(90));
+  vector<size_t> counts = columns.histogram();
+  printf("Histogram:\n");
+  for (int bin = 0; bin <= kMaxScore; bin += 10) {
+    size_t bin_count = 0;
+    for (int avg = bin; avg < bin + 10 && avg <= kMaxScore; ++avg)
+      bin_count += counts[avg];
+    printf("%3d-%3d: %zu\n", bin, std::min(bin + 9, kMaxScore), bin_count);
   }
 }
 
 
-bool history_sort(const GradeHistory& lhs, const GradeHistory& rhs) {
-  return lhs.average > rhs.average;
+// Appends one report line to out_buffer.
+void format_report_line(const GradeColumns& columns, uint32_t student,
+                        OutputBuffer* out_buffer) {
+  out_buffer->append(columns.first_name(student));
+  out_buffer->push_back(',');
+  out_buffer->append(columns.last_name(student));
+  out_buffer->append("\t(");
+  out_buffer->append_int(columns.average(student));
+  out_buffer->append("%)\t(");
+  out_buffer->append(columns.letter_grade(student));
+  out_buffer->append("):");
+  for (int j = 0; j < columns.n_grades(student); ++j) {
+    out_buffer->push_back('\t');
+    out_buffer->append_int(columns.score(student, j));
+  }
+  out_buffer->push_back('\n');
 }
 
 
-int main(int argc, char *argv[]) {
-  vector<GradeHistory> histories;
-  parse_input_file(input_file_name, &histories);
-  std::sort(histories.begin(), histories.end(), history_sort);
-  save_report_card(output_file_name, histories);
+// Best average first, input order among equal averages
+bool student_sort(const GradeColumns& columns, uint32_t lhs, uint32_t rhs) {
+  if (columns.average(lhs) != columns.average(rhs))
+    return columns.average(lhs) > columns.average(rhs);
+  return lhs < rhs;
+}
+
+
+// Sorts n_threads runs of the students in parallel, then k-way merges
+// the runs straight into the report. Rows are written as soon as the
+// merge produces them, so output overlaps the last stage of the sort.
+// Returns false, after saying why, if the report could not be written.
+bool sort_and_save_report_card(string file_name, const GradeColumns& columns,
+                               int n_threads) {
+  INSTR_SCOPED_TIMER(report_timer);
+  size_t n_students = columns.n_students();
+  INSTR_COUNT(rows_written, n_students);
+  vector<uint32_t> order(n_students);
+  std::iota(order.begin(), order.end(), 0);
+  auto less = [&](uint32_t lhs, uint32_t rhs) {
+    return student_sort(columns, lhs, rhs);
+  };
+  vector<size_t> run_bounds;
+  for (int i = 0; i <= n_threads; ++i)
+    run_bounds.push_back(n_students * i / n_threads);
+  vector<std::thread> workers;
+  for (int i = 0; i < n_threads; ++i) {
+    workers.emplace_back([&, i]() {
+      std::sort(order.begin() + run_bounds[i],
+                order.begin() + run_bounds[i+1], less);
+    });
+  }
+  for (auto& worker : workers)
+    worker.join();
+
+  OutputFile out_file(file_name);
+  if (!out_file.is_open()) {
+    printf("File could not be opened\n");
+    return false;
+  }
+  // Heap of (run cursor, run end) ordered so the best average is on top
+  vector<pair<size_t, size_t>> heads;
+  for (int i = 0; i < n_threads; ++i) {
+    if (run_bounds[i] < run_bounds[i+1])
+      heads.push_back(std::make_pair(run_bounds[i], run_bounds[i+1]));
+  }
+  auto head_comp = [&](const pair<size_t, size_t>& lhs,
+                       const pair<size_t, size_t>& rhs) {
+    return less(order[rhs.first], order[lhs.first]);
+  };
+  std::make_heap(heads.begin(), heads.end(), head_comp);
+  BufferedWriter writer(&out_file);
+  while (!heads.empty()) {
+    std::pop_heap(heads.begin(), heads.end(), head_comp);
+    pair<size_t, size_t>& head = heads.back();
+    format_report_line(columns, order[head.first], writer.buffer());
+    if (!writer.maybe_flush())
+      break;
+    if (++head.first < head.second)
+      std::push_heap(heads.begin(), heads.end(), head_comp);
+    else
+      heads.pop_back();
+  }
+  if (!writer.flush() || !out_file.close()) {
+    printf("Could not write %s: %s\n", file_name.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+
+// Counting sort of the students keyed on average. Averages are whole
+// percentages, so one pass builds the best-first report order and the
+// bucket boundaries give any student's rank in O(1). Students with the
+// same average keep their input order; use the full sort when a
+// different order within a bucket matters.
+class AverageIndex {
+ public:
+  explicit AverageIndex(const GradeColumns& columns) {
+    // bucket_begin_[b] is where bucket b starts in order_. Bucket 0
+    // holds the highest average.
+    size_t n_students = columns.n_students();
+    bucket_begin_.assign(kMaxScore + 2, 0);
+    buckets_.reserve(n_students);
+    for (size_t s = 0; s < n_students; ++s) {
+      int bucket = kMaxScore - columns.average(s);
+      buckets_.push_back(bucket);
+      ++bucket_begin_[bucket + 1];
+    }
+    for (int b = 0; b <= kMaxScore; ++b)
+      bucket_begin_[b+1] += bucket_begin_[b];
+    order_.resize(n_students);
+    vector<uint32_t> next(bucket_begin_.begin(), bucket_begin_.end() - 1);
+    for (size_t i = 0; i < n_students; ++i)
+      order_[next[buckets_[i]]++] = i;
+  }
+
+  // 1 based rank, students with equal averages share a rank
+  uint32_t rank(uint32_t student) const {
+    return bucket_begin_[buckets_[student]] + 1;
+  }
+
+  // Students from best to worst average
+  const vector<uint32_t>& order() const { return order_; }
+
+  vector<uint32_t> top(size_t k) const {
+    k = std::min(k, order_.size());
+    return vector<uint32_t>(order_.cbegin(), order_.cbegin() + k);
+  }
+
+  // The k lowest averages, worst first
+  vector<uint32_t> bottom(size_t k) const {
+    k = std::min(k, order_.size());
+    return vector<uint32_t>(order_.crbegin(), order_.crbegin() + k);
+  }
+
+ private:
+  vector<uint8_t> buckets_;
+  vector<uint32_t> bucket_begin_;
+  vector<uint32_t> order_;
+};
+
+
+// Writes the students in the given order. Every round, each thread
+// formats the next block of rows into its own buffer, the buffer sizes
+// are prefix summed into file offsets and the threads pwrite their
+// buffers into place. Returns false, after saying why, if the report
+// could not be written.
+bool save_report_card(string file_name, const GradeColumns& columns,
+                      const vector<uint32_t>& order, int n_threads) {
+  INSTR_SCOPED_TIMER(report_timer);
+  INSTR_COUNT(rows_written, order.size());
+  static const size_t kRowsPerBlock = 1 << 14;
+  OutputFile out_file(file_name);
+  if (!out_file.is_open()) {
+    printf("File could not be opened\n");
+    return false;
+  }
+  vector<OutputBuffer> buffers(n_threads);
+  // errno of each thread's last failed write, 0 while all is well
+  vector<int> write_errors(n_threads, 0);
+  off_t file_offset = 0;
+  size_t next_row = 0;
+  while (next_row < order.size()) {
+    vector<std::thread> workers;
+    for (int t = 0; t < n_threads; ++t) {
+      size_t begin = std::min(next_row + t * kRowsPerBlock, order.size());
+      size_t end = std::min(begin + kRowsPerBlock, order.size());
+      workers.emplace_back([&, t, begin, end]() {
+        buffers[t].clear();
+        for (size_t i = begin; i < end; ++i)
+          format_report_line(columns, order[i], &buffers[t]);
+      });
+    }
+    for (auto& worker : workers)
+      worker.join();
+    workers.clear();
+    for (int t = 0; t < n_threads; ++t) {
+      off_t offset = file_offset;
+      file_offset += buffers[t].size();
+      workers.emplace_back([&, t, offset]() {
+        if (!out_file.write_at(buffers[t].data(), buffers[t].size(), offset))
+          write_errors[t] = errno;
+      });
+    }
+    for (auto& worker : workers)
+      worker.join();
+    if (std::any_of(write_errors.cbegin(), write_errors.cend(),
+                    [](int error) { return error != 0; }))
+      break;
+    next_row += n_threads * kRowsPerBlock;
+  }
+  int error = *std::max_element(write_errors.cbegin(), write_errors.cend());
+  if (error == 0 && !out_file.close())
+    error = errno;
+  if (error != 0) {
+    printf("Could not write %s: %s\n", file_name.c_str(), strerror(error));
+    return false;
+  }
+  return true;
+}
+
+
+void print_students(const char* title, const GradeColumns& columns,
+                    const vector<uint32_t>& students) {
+  printf("%s\n", title);
+  OutputBuffer lines;
+  for (uint32_t idx : students)
+    format_report_line(columns, idx, &lines);
+  fwrite(lines.data(), 1, lines.size(), stdout);
+}
+
+
+// Array appended to by one thread while others read it. Blocks never
+// move once allocated, and size() is published with release order
+// after the element is written, so a reader may read any index below
+// a size() it has seen.
+template <typename T>
+class AppendLog {
+ public:
+  AppendLog() : blocks_(kMaxBlocks), size_(0) {}
+  ~AppendLog() {
+    for (auto& block : blocks_)
+      delete[] block.load(std::memory_order_relaxed);
+  }
+  AppendLog(const AppendLog&) = delete;
+  AppendLog& operator=(const AppendLog&) = delete;
+
+  // Writer thread only
+  void push_back(const T& value) {
+    size_t n = size_.load(std::memory_order_relaxed);
+    size_t block = n >> kBlockBits;
+    if (block >= kMaxBlocks) {
+      printf("Error, event log full\n");
+      abort();
+    }
+    if ((n & kBlockMask) == 0)
+      blocks_[block].store(new T[kBlockMask + 1], std::memory_order_relaxed);
+    blocks_[block].load(std::memory_order_relaxed)[n & kBlockMask] = value;
+    size_.store(n + 1, std::memory_order_release);
+  }
+
+  size_t size() const { return size_.load(std::memory_order_acquire); }
+  const T& operator[](size_t i) const {
+    return blocks_[i >> kBlockBits].load(std::memory_order_relaxed)
+        [i & kBlockMask];
+  }
+
+ private:
+  static const size_t kBlockBits = 16;
+  static const size_t kBlockMask = (size_t(1) << kBlockBits) - 1;
+  static const size_t kMaxBlocks = 1 << 16;
+
+  vector<std::atomic<T*>> blocks_;
+  std::atomic<size_t> size_;
+};
+
+struct ScoreEvent {
+  uint32_t student;
+  int score;
+};
+
+struct StudentName {
+  string_view first_name;
+  string_view last_name;
+};
+
+// Keeps every student's average and letter grade current as scores
+// arrive, ranked by average. A Fenwick tree over the average buckets
+// (bucket 0 holds the highest average, as in AverageIndex) counts the
+// students in each, so rank() is a prefix sum in O(log kMaxScore) and
+// top(k) walks the best buckets. Every score is also appended to an
+// event log, from which report snapshots are rebuilt on another
+// thread. Students appear from their first score.
+class OnlineGradeBook {
+ public:
+  OnlineGradeBook()
+      : bucket_counts_(kMaxScore + 2, 0), members_(kMaxScore + 1) {}
+
+  void add_scores(string_view first_name, string_view last_name,
+                  const int* scores, int n_scores) {
+    if (n_scores == 0)
+      return;
+    uint32_t student = find_or_add(first_name, last_name);
+    GradeHistory& history = histories_[student];
+    remove_from_bucket(student);
+    for (int i = 0; i < n_scores; ++i) {
+      sums_[student] += scores[i];
+      events_.push_back({student, scores[i]});
+    }
+    INSTR_COUNT(score_events, n_scores);
+    history.n_grades += n_scores;
+    history.average = std::round(static_cast<double>(sums_[student]) /
+                                 history.n_grades);
+    history.letter_grade = assign_letter_grade(history.average);
+    add_to_bucket(student);
+  }
+
+  // Student id, or -1 for a name without scores
+  int find(string_view first_name, string_view last_name) const {
+    string key;
+    key.append(first_name).append(",").append(last_name);
+    auto found = ids_.find(key);
+    return found == ids_.end() ? -1 : static_cast<int>(found->second);
+  }
+
+  // 1 based rank, students with equal averages share a rank
+  uint32_t rank(uint32_t student) const {
+    uint32_t better = 0;
+    for (int i = bucket(student); i > 0; i -= i & -i)
+      better += bucket_counts_[i];
+    return better + 1;
+  }
+
+  // The k best students, ties in no particular order
+  vector<uint32_t> top(size_t k) const {
+    vector<uint32_t> students;
+    for (int b = 0; b <= kMaxScore && students.size() < k; ++b) {
+      size_t n_take = std::min(k - students.size(), members_[b].size());
+      students.insert(students.end(), members_[b].cbegin(),
+                      members_[b].cbegin() + n_take);
+    }
+    return students;
+  }
+
+  const GradeHistory& history(uint32_t student) const {
+    return histories_[student];
+  }
+  size_t n_students() const { return histories_.size(); }
+
+  // Students in order of their first score, and every score so far.
+  // Both may be read from other threads.
+  const AppendLog<StudentName>& names() const { return names_; }
+  const AppendLog<ScoreEvent>& events() const { return events_; }
+
+ private:
+  int bucket(uint32_t student) const {
+    return kMaxScore - std::clamp(histories_[student].average, 0, kMaxScore);
+  }
+
+  uint32_t find_or_add(string_view first_name, string_view last_name) {
+    string key;
+    key.append(first_name).append(",").append(last_name);
+    auto found = ids_.find(key);
+    if (found != ids_.end())
+      return found->second;
+    // Names are copied once into the arena and live as long as the book
+    char* text = static_cast<char*>(
+        name_arena_.resource()->allocate(key.size(), 1));
+    memcpy(text, key.data(), key.size());
+    StudentName name = {string_view(text, first_name.size()),
+                        string_view(text + first_name.size() + 1,
+                                    last_name.size())};
+    uint32_t student = histories_.size();
+    ids_.emplace(std::move(key), student);
+    names_.push_back(name);
+    GradeHistory history = {name.first_name, name.last_name, 0, 0, 0,
+                            assign_letter_grade(0)};
+    histories_.push_back(history);
+    sums_.push_back(0);
+    slots_.push_back(0);
+    add_to_bucket(student);
+    return student;
+  }
+
+  void add_to_bucket(uint32_t student) {
+    int b = bucket(student);
+    slots_[student] = members_[b].size();
+    members_[b].push_back(student);
+    for (int i = b + 1; i <= kMaxScore + 1; i += i & -i)
+      ++bucket_counts_[i];
+  }
+
+  void remove_from_bucket(uint32_t student) {
+    int b = bucket(student);
+    uint32_t moved = members_[b].back();
+    members_[b][slots_[student]] = moved;
+    slots_[moved] = slots_[student];
+    members_[b].pop_back();
+    for (int i = b + 1; i <= kMaxScore + 1; i += i & -i)
+      --bucket_counts_[i];
+  }
+
+  arena::PhaseArena name_arena_;
+  std::unordered_map<string, uint32_t> ids_;
+  vector<GradeHistory> histories_;
+  vector<long long> sums_;
+  // Fenwick tree, 1 based, of students per bucket
+  vector<uint32_t> bucket_counts_;
+  vector<vector<uint32_t>> members_;
+  // Position of each student in its bucket's members_
+  vector<uint32_t> slots_;
+  AppendLog<StudentName> names_;
+  AppendLog<ScoreEvent> events_;
+};
+
+// Rebuilds the book as it stood after the first n_events scores as one
+// parsed chunk. Each student's scores are gathered with a counting
+// pass, then added the same way parse_chunk adds a parsed line.
+void build_snapshot(const OnlineGradeBook& online, size_t n_events,
+                    ParsedRows* rows) {
+  const AppendLog<ScoreEvent>& events = online.events();
+  const AppendLog<StudentName>& names = online.names();
+  size_t n_students = 0;
+  for (size_t i = 0; i < n_events; ++i)
+    n_students = std::max<size_t>(n_students, events[i].student + 1);
+  vector<size_t> next(n_students + 1, 0);
+  for (size_t i = 0; i < n_events; ++i)
+    ++next[events[i].student + 1];
+  std::partial_sum(next.begin(), next.end(), next.begin());
+  vector<size_t> row_begin(next.begin(), next.end());
+  vector<int> grades(n_events);
+  for (size_t i = 0; i < n_events; ++i)
+    grades[next[events[i].student]++] = events[i].score;
+  rows->n_grades.reserve(n_students);
+  rows->scores.reserve(n_events);
+  for (size_t s = 0; s < n_students; ++s) {
+    add_row(names[s].first_name, names[s].last_name,
+            grades.data() + row_begin[s], row_begin[s + 1] - row_begin[s],
+            rows);
+  }
+}
+
+// Writes a report of the online book every period seconds on its own
+// thread. The ingesting thread is never held up: a snapshot is just
+// the length of the event log at that moment, and the report is built
+// from that prefix. Each report goes to a temporary file which is then
+// renamed over the last one, so readers never see half a report.
+class SnapshotReporter {
+ public:
+  SnapshotReporter(const OnlineGradeBook& online, const string& file_name,
+                   double period, int n_threads)
+      : online_(online), file_name_(file_name), period_(period),
+        n_threads_(n_threads), stopping_(false), n_reported_(0),
+        reporter_(&SnapshotReporter::run, this) {}
+
+  ~SnapshotReporter() { stop(); }
+
+  // Writes a last report of everything ingested so far and stops
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopping_)
+        return;
+      stopping_ = true;
+    }
+    stop_requested_.notify_one();
+    reporter_.join();
+    write_snapshot();
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_requested_.wait_for(
+        lock, std::chrono::duration<double>(period_),
+        [this] { return stopping_; })) {
+      lock.unlock();
+      write_snapshot();
+      lock.lock();
+    }
+  }
+
+  void write_snapshot() {
+    size_t n_events = online_.events().size();
+    if (n_events == n_reported_ && n_events > 0)
+      return;
+    vector<ParsedRows> rows(1);
+    build_snapshot(online_, n_events, &rows[0]);
+    GradeColumns snapshot(&rows);
+    AverageIndex index(snapshot);
+    string temp_name = file_name_ + ".tmp";
+    // Keep the last good report rather than replace it with a short one
+    if (!save_report_card(temp_name, snapshot, index.order(), n_threads_))
+      return;
+    if (rename(temp_name.c_str(), file_name_.c_str()) != 0)
+      printf("Could not replace %s\n", file_name_.c_str());
+    n_reported_ = n_events;
+    INSTR_COUNT(snapshots_written, 1);
+  }
+
+  const OnlineGradeBook& online_;
+  string file_name_;
+  double period_;
+  int n_threads_;
+  std::mutex mutex_;
+  std::condition_variable stop_requested_;
+  bool stopping_;
+  size_t n_reported_;
+  std::thread reporter_;
+};
+
+// Reads lines from in until it ends. A "First,Last\tscore..." line
+// adds those scores to the student. "?rank First,Last" and "?top N"
+// are answered at once from the live book.
+int run_online(FILE* in, double period, int n_threads) {
+  OnlineGradeBook online;
+  SnapshotReporter reporter(online, output_file_name, period, n_threads);
+  vector<int> scores;
+  char* line = nullptr;
+  size_t line_capacity = 0;
+  ssize_t line_len;
+  while ((line_len = getline(&line, &line_capacity, in)) > 0) {
+    const char* end = line + line_len;
+    while (end > line && (end[-1] == '\n' || end[-1] == '\r'))
+      --end;
+    if (line[0] != '?') {
+      GradeHistory parsed;
+      scores.clear();
+      if (!parse_line(line, end, &scores, &parsed))
+        continue;
+      if (std::any_of(scores.cbegin(), scores.cend(),
+                      [](int score) { return score > kMaxScore; })) {
+        printf("Scores above %d are not allowed: %.*s\n", kMaxScore,
+               static_cast<int>(end - line), line);
+        fflush(stdout);
+        continue;
+      }
+      online.add_scores(parsed.first_name, parsed.last_name,
+                        scores.data(), scores.size());
+      continue;
+    }
+    string_view command(line, end - line);
+    if (command.substr(0, 6) == "?rank ") {
+      string_view name = command.substr(6);
+      size_t comma = name.find(',');
+      int student = comma == string_view::npos ? -1 :
+          online.find(name.substr(0, comma), name.substr(comma + 1));
+      if (student < 0) {
+        printf("No scores for %.*s\n", static_cast<int>(name.size()),
+               name.data());
+      } else {
+        printf("Rank of %.*s: %u of %zu\n", static_cast<int>(name.size()),
+               name.data(), online.rank(student), online.n_students());
+      }
+    } else if (command.substr(0, 5) == "?top ") {
+      size_t k = std::atol(string(command.substr(5)).c_str());
+      for (uint32_t student : online.top(k)) {
+        const GradeHistory& history = online.history(student);
+        printf("%.*s,%.*s\t(%d%%)\t(%s)\n",
+               static_cast<int>(history.first_name.size()),
+               history.first_name.data(),
+               static_cast<int>(history.last_name.size()),
+               history.last_name.data(), history.average,
+               history.letter_grade);
+      }
+    } else {
+      printf("Unknown command: %.*s\n", static_cast<int>(command.size()),
+             command.data());
+    }
+    fflush(stdout);
+  }
+  free(line);
+  reporter.stop();
+  printf("Students: %zu\tScores: %zu\n", online.n_students(),
+         online.events().size());
   return 0;
 }
+
+// Usage: final_grades [--full-sort] [--top N] [--bottom N]
+//                     [--rank First,Last]
+//        final_grades --online [report_period_seconds] < events
+int main(int argc, char *argv[]) {
+  INSTR_INSTALL_DUMP("final_grades");
+  bool full_sort = false;
+  size_t n_top = 0;
+  size_t n_bottom = 0;
+  string rank_name;
+  int n_threads = std::max(1u, std::thread::hardware_concurrency());
+  if (argc >= 2 && string(argv[1]) == "--online") {
+    double period = argc >= 3 ? std::atof(argv[2]) : 1.0;
+    return run_online(stdin, period > 0 ? period : 1.0, n_threads);
+  }
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--full-sort")
+      full_sort = true;
+    else if (arg == "--top" && i + 1 < argc)
+      n_top = std::atol(argv[++i]);
+    else if (arg == "--bottom" && i + 1 < argc)
+      n_bottom = std::atol(argv[++i]);
+    else if (arg == "--rank" && i + 1 < argc)
+      rank_name = argv[++i];
+  }
+  GradeColumns columns;
+  parse_input_file(input_file_name, n_threads, &columns);
+  print_class_stats(columns);
+  // The index answers --top, --bottom and --rank whichever way the
+  // report is written
+  AverageIndex index(columns);
+  bool saved = full_sort ?
+      sort_and_save_report_card(output_file_name, columns, n_threads) :
+      save_report_card(output_file_name, columns, index.order(), n_threads);
+  if (n_top > 0)
+    print_students("Top students:", columns, index.top(n_top));
+  if (n_bottom > 0)
+    print_students("Bottom students:", columns, index.bottom(n_bottom));
+  if (!rank_name.empty()) {
+    size_t comma = rank_name.find(',');
+    vector<uint32_t> students;
+    if (comma != string::npos) {
+      string_view name(rank_name);
+      students = columns.find(name.substr(0, comma),
+                              name.substr(comma + 1));
+    }
+    if (students.empty())
+      printf("No student named %s\n", rank_name.c_str());
+    for (uint32_t student : students) {
+      printf("Rank of %s: %u of %zu\n", rank_name.c_str(),
+             index.rank(student), columns.n_students());
+    }
+  }
+  return saved ? 0 : -1;
+}
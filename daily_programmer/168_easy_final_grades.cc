@@ -1,15 +1,22 @@
-#include <random>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
-#include <ctime>
+#include <cstring>
 
-#include <fstream>
 #include <algorithm>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
+#include "buffered_writer.h"
+#include "mapped_file.h"
+#include "../common/instrumentation.h"
+
 using std::string;
+using std::string_view;
 using std::vector;
 using std::pair;
 
@@ -17,81 +24,312 @@ static char out_file_name[] = "test_scores.txt";
 static char name_file_name[] = "name_list.txt";
 static double mean = 75;
 static double std_dev = 15;
+static int kNumTests = 5;
+static uint64_t kDefaultSeed = 168;
+static size_t kRowsPerBlock = 1 << 14;
 
-void get_name_list(string file_name,
-                   vector<pair<string, string>>* name_vector) {
-  std::ifstream in_file(file_name);
-  char delim = ',';
+INSTR_COUNTER(rows_generated, "generator_rows_generated");
+INSTR_TIMER(generate_timer, "generator_generate");
 
-  if (!in_file.is_open()) {
-    printf("File could not be opened\n");
-    return;
+// Philox4x32-10 counter based generator (Salmon et al., "Parallel
+// random numbers: as easy as 1, 2, 3"). The output is a pure function
+// of (key, counter), so row i always gets the same random numbers no
+// matter which thread generates it or how many threads there are.
+class Philox4x32 {
+ public:
+  explicit Philox4x32(uint64_t seed) {
+    key_[0] = static_cast<uint32_t>(seed);
+    key_[1] = static_cast<uint32_t>(seed >> 32);
+  }
+
+  void operator()(uint64_t counter_hi, uint64_t counter_lo,
+                  uint32_t out[4]) const {
+    static const uint32_t kM0 = 0xD2511F53;
+    static const uint32_t kM1 = 0xCD9E8D57;
+    static const uint32_t kW0 = 0x9E3779B9;
+    static const uint32_t kW1 = 0xBB67AE85;
+    uint32_t ctr[4] = {static_cast<uint32_t>(counter_lo),
+                       static_cast<uint32_t>(counter_lo >> 32),
+                       static_cast<uint32_t>(counter_hi),
+                       static_cast<uint32_t>(counter_hi >> 32)};
+    uint32_t key[2] = {key_[0], key_[1]};
+    for (int round = 0; round < 10; ++round) {
+      uint64_t prod0 = static_cast<uint64_t>(kM0) * ctr[0];
+      uint64_t prod1 = static_cast<uint64_t>(kM1) * ctr[2];
+      uint32_t next[4] = {
+        static_cast<uint32_t>(prod1 >> 32) ^ ctr[1] ^ key[0],
+        static_cast<uint32_t>(prod1),
+        static_cast<uint32_t>(prod0 >> 32) ^ ctr[3] ^ key[1],
+        static_cast<uint32_t>(prod0)};
+      std::copy(next, next + 4, ctr);
+      key[0] += kW0;
+      key[1] += kW1;
+    }
+    std::copy(ctr, ctr + 4, out);
   }
-  string str;
-  while (std::getline(in_file, str)) {
-    size_t delim_loc = str.find(delim);
-    string first_name = str.substr(0, delim_loc);
-    string last_name = str.substr(delim_loc+1);
-    last_name.pop_back();
-    name_vector->push_back(std::make_pair(first_name, last_name));
+
+ private:
+  uint32_t key_[2];
+};
+
+
+// Maps a 32 bit integer to a double in (0, 1]
+inline double to_unit(uint32_t bits) {
+  return (bits + 1.0) * (1.0 / 4294967296.0);
+}
+
+
+typedef vector<pair<string_view, string_view>> name_vect;
+
+// Splits a "First,Last" line, dropping a trailing carriage return
+pair<string_view, string_view> split_name_line(const char* begin,
+                                               const char* end) {
+  if (end > begin && *(end - 1) == '\r')
+    --end;
+  const char* delim = static_cast<const char*>(
+      memchr(begin, ',', end - begin));
+  if (delim == nullptr)
+    return std::make_pair(string_view(begin, end - begin), string_view());
+  return std::make_pair(string_view(begin, delim - begin),
+                        string_view(delim + 1, end - delim - 1));
+}
+
+
+// Calls visit(line_number, begin, end) for every non-empty line.
+// Blank lines in the name list are skipped rather than becoming names.
+template <typename Visitor>
+void for_each_line(const MappedFile& file, Visitor visit) {
+  const char* cur = file.data();
+  const char* file_end = cur + file.size();
+  uint64_t line_number = 0;
+  while (cur < file_end) {
+    const char* line_end = static_cast<const char*>(
+        memchr(cur, '\n', file_end - cur));
+    if (line_end == nullptr)
+      line_end = file_end;
+    if (line_end > cur && !(line_end == cur + 1 && *cur == '\r'))
+      visit(line_number++, cur, line_end);
+    cur = line_end + 1;
   }
 }
 
 
-float get_random_grade(std::normal_distribution<double> dist) {
-  static std::random_device rd;
-  static std::mt19937 e2(rd());
-  int num = std::ceil(dist(e2));
-  if (num > 100)
-    num = 100;
-  else if (num < 0)
-    num = 0;
-  return num;
+void get_name_list(const MappedFile& name_file, name_vect* name_vector) {
+  for_each_line(name_file, [&](uint64_t, const char* begin,
+                               const char* end) {
+    name_vector->push_back(split_name_line(begin, end));
+  });
 }
 
 
-void gen_random_scores(std::string file_out_str,
-                       std::string name_file_str, int n) {
-  std::srand(unsigned(std::time(0)));
-  vector<pair<string, string>> name_vector;
-  get_name_list(name_file_str, &name_vector);
-  int num_names = name_vector.size();
-  if (num_names < n) {
-    printf("Error, n is larger than the number of names");
+// Picks n distinct names without materializing the name list. The
+// lines are counted, Floyd's algorithm draws n distinct line numbers
+// in O(n) memory, and a second pass over the mapping collects those
+// lines. The picks are then shuffled so the output is not in file order.
+void get_sampled_names(const MappedFile& name_file, uint64_t n,
+                       const Philox4x32& rng, name_vect* name_vector) {
+  uint64_t n_lines = 0;
+  for_each_line(name_file, [&](uint64_t, const char*, const char*) {
+    ++n_lines;
+  });
+  if (n_lines < n)
     return;
+  // Stream 2 of the generator is reserved for name selection
+  auto uniform_below = [&](uint64_t counter, uint64_t bound) {
+    uint32_t bits[4];
+    rng(2, counter, bits);
+    uint64_t wide = (static_cast<uint64_t>(bits[0]) << 32) | bits[1];
+    return static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(wide) * bound) >> 64);
+  };
+  std::unordered_set<uint64_t> chosen;
+  chosen.reserve(n);
+  for (uint64_t j = n_lines - n; j < n_lines; ++j) {
+    uint64_t pick = uniform_below(j, j + 1);
+    if (!chosen.insert(pick).second)
+      chosen.insert(j);
   }
-  std::random_shuffle(name_vector.begin(), name_vector.end());
-  vector<pair<string, string>> rand_name_vector;
-  for (int i = 0; i < n; ++i) {
-    rand_name_vector.push_back(name_vector[i]);
-  }
-  string out_str;
-  std::normal_distribution<double> dist(mean, std_dev);
-  std::ofstream out_file(file_out_str);
-  for (auto iter_ = rand_name_vector.cbegin();
-       iter_ != rand_name_vector.cend(); ++iter_) {
-    out_file << iter_->first << ","
-             << iter_->second << "\t"
-             << get_random_grade(dist) << "\t"
-             << get_random_grade(dist) << "\t"
-             << get_random_grade(dist) << "\t"
-             << get_random_grade(dist) << "\t"
-             << get_random_grade(dist) << "\t" << std::endl;
+  vector<uint64_t> picks(chosen.cbegin(), chosen.cend());
+  std::sort(picks.begin(), picks.end());
+  name_vector->reserve(n);
+  auto next_pick = picks.cbegin();
+  for_each_line(name_file, [&](uint64_t line_number, const char* begin,
+                               const char* end) {
+    if (next_pick != picks.cend() && *next_pick == line_number) {
+      name_vector->push_back(split_name_line(begin, end));
+      ++next_pick;
+    }
+  });
+  // Fisher-Yates on the n picks only
+  for (uint64_t i = name_vector->size(); i > 1; --i) {
+    uint64_t swap_idx = uniform_below(n_lines + i, i);
+    std::swap((*name_vector)[i - 1], (*name_vector)[swap_idx]);
   }
 }
 
 
+// Fills names and grades (row major, kNumTests per row) for rows
+// [first_row, first_row + n_rows). Each row draws two Philox blocks:
+// block 0 picks the name and block 0/1 together feed the Box-Muller
+// pairs. With num_names == 0 row r simply uses name r. The Box-Muller
+// step runs as one loop over the whole block of uniforms so the
+// compiler can vectorize the log/sqrt/sin/cos calls.
+void gen_score_block(const Philox4x32& rng, uint64_t first_row,
+                     size_t n_rows, uint32_t num_names,
+                     vector<uint32_t>* names, vector<int>* grades) {
+  int n_pairs = (kNumTests + 1) / 2;
+  vector<double> u1(n_rows * n_pairs);
+  vector<double> u2(n_rows * n_pairs);
+  names->resize(n_rows);
+  INSTR_COUNT(rows_generated, n_rows);
+  for (size_t r = 0; r < n_rows; ++r) {
+    uint32_t bits[8];
+    rng(0, first_row + r, bits);
+    rng(1, first_row + r, bits + 4);
+    // Name sampling with replacement, scaled instead of a biased modulo
+    if (num_names == 0)
+      (*names)[r] = first_row + r;
+    else
+      (*names)[r] = (static_cast<uint64_t>(bits[0]) * num_names) >> 32;
+    for (int p = 0; p < n_pairs; ++p) {
+      u1[r * n_pairs + p] = to_unit(bits[1 + 2 * p]);
+      u2[r * n_pairs + p] = to_unit(bits[2 + 2 * p]);
+    }
+  }
+  vector<double> normals(n_rows * n_pairs * 2);
+  for (size_t i = 0; i < u1.size(); ++i) {
+    double radius = std::sqrt(-2.0 * std::log(u1[i]));
+    double theta = 2.0 * M_PI * u2[i];
+    normals[2 * i] = mean + std_dev * radius * std::cos(theta);
+    normals[2 * i + 1] = mean + std_dev * radius * std::sin(theta);
+  }
+  grades->resize(n_rows * kNumTests);
+  for (size_t r = 0; r < n_rows; ++r) {
+    for (int t = 0; t < kNumTests; ++t) {
+      int num = std::ceil(normals[r * n_pairs * 2 + t]);
+      (*grades)[r * kNumTests + t] = std::clamp(num, 0, 100);
+    }
+  }
+}
+
+
+// Writes n rows of random scores. Rows are generated in blocks on
+// n_threads workers and each block is pwritten at its prefix-sum
+// offset, so the output depends only on seed and n. Names are drawn
+// with replacement unless unique_names is set, in which case n
+// distinct names are sampled from the file. Returns false, after
+// saying why, if the scores could not be written.
+bool gen_random_scores(std::string file_out_str,
+                       std::string name_file_str, uint64_t n,
+                       uint64_t seed, bool unique_names, int n_threads) {
+  INSTR_SCOPED_TIMER(generate_timer);
+  MappedFile name_file(name_file_str);
+  if (!name_file.is_open()) {
+    printf("File could not be opened\n");
+    return false;
+  }
+  Philox4x32 rng(seed);
+  name_vect name_vector;
+  if (unique_names)
+    get_sampled_names(name_file, n, rng, &name_vector);
+  else
+    get_name_list(name_file, &name_vector);
+  if (unique_names && name_vector.size() < n) {
+    printf("Error, n is larger than the number of names\n");
+    return false;
+  }
+  if (name_vector.empty()) {
+    printf("Error, no names to choose from\n");
+    return false;
+  }
+  uint32_t num_names = unique_names ? 0 : name_vector.size();
+  OutputFile out_file(file_out_str);
+  if (!out_file.is_open()) {
+    printf("File could not be opened\n");
+    return false;
+  }
+  vector<OutputBuffer> buffers(n_threads);
+  // errno of each thread's last failed write, 0 while all is well
+  vector<int> write_errors(n_threads, 0);
+  off_t file_offset = 0;
+  for (uint64_t next_row = 0; next_row < n;
+       next_row += n_threads * kRowsPerBlock) {
+    vector<std::thread> workers;
+    for (int t = 0; t < n_threads; ++t) {
+      uint64_t begin = std::min<uint64_t>(next_row + t * kRowsPerBlock, n);
+      uint64_t end = std::min<uint64_t>(begin + kRowsPerBlock, n);
+      workers.emplace_back([&, t, begin, end]() {
+        vector<uint32_t> names;
+        vector<int> grades;
+        gen_score_block(rng, begin, end - begin, num_names,
+                        &names, &grades);
+        OutputBuffer* out_buffer = &buffers[t];
+        out_buffer->clear();
+        for (size_t r = 0; r < names.size(); ++r) {
+          const pair<string_view, string_view>& name = name_vector[names[r]];
+          out_buffer->append(name.first);
+          out_buffer->push_back(',');
+          out_buffer->append(name.second);
+          out_buffer->push_back('\t');
+          for (int i = 0; i < kNumTests; ++i) {
+            out_buffer->append_int(grades[r * kNumTests + i]);
+            out_buffer->push_back('\t');
+          }
+          out_buffer->push_back('\n');
+        }
+      });
+    }
+    for (auto& worker : workers)
+      worker.join();
+    workers.clear();
+    for (int t = 0; t < n_threads; ++t) {
+      off_t offset = file_offset;
+      file_offset += buffers[t].size();
+      workers.emplace_back([&, t, offset]() {
+        if (!out_file.write_at(buffers[t].data(), buffers[t].size(), offset))
+          write_errors[t] = errno;
+      });
+    }
+    for (auto& worker : workers)
+      worker.join();
+    if (std::any_of(write_errors.cbegin(), write_errors.cend(),
+                    [](int error) { return error != 0; }))
+      break;
+  }
+  int error = *std::max_element(write_errors.cbegin(), write_errors.cend());
+  if (error == 0 && !out_file.close())
+    error = errno;
+  if (error != 0) {
+    printf("Could not write %s: %s\n", file_out_str.c_str(), strerror(error));
+    return false;
+  }
+  return true;
+}
+
+
+// Usage: final_grades_gen n [seed] [--unique]
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-        printf("You must provide exactly one argument\n");
+  INSTR_INSTALL_DUMP("final_grades_gen");
+  bool unique_names = false;
+  vector<char*> numbers;
+  for (int i = 1; i < argc; ++i) {
+    if (string(argv[i]) == "--unique")
+      unique_names = true;
+    else
+      numbers.push_back(argv[i]);
+  }
+  if (numbers.size() != 1 && numbers.size() != 2) {
+        printf("You must provide n and optionally a seed\n");
         exit(0);
   }
-  int n = std::atoi(argv[1]);
-  printf("n: %d\n", n);
+  uint64_t n = std::strtoull(numbers[0], nullptr, 10);
+  uint64_t seed = (numbers.size() == 2) ?
+      std::strtoull(numbers[1], nullptr, 10) : kDefaultSeed;
+  printf("n: %llu seed: %llu\n", static_cast<unsigned long long>(n),
+         static_cast<unsigned long long>(seed));
+  int n_threads = std::max(1u, std::thread::hardware_concurrency());
   string out_file_str = out_file_name;
   string name_file_str = name_file_name;
-  gen_random_scores(out_file_str, name_file_str, n);
-  return 0;
+  return gen_random_scores(out_file_str, name_file_str, n, seed,
+                           unique_names, n_threads) ? 0 : -1;
 }
-
-
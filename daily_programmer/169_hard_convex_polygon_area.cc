@@ -1,10 +1,24 @@
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include <charconv>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <fstream>
+#include <limits>
+#include <random>
 #include <sstream>
 #include <algorithm>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "batch_runner.h"
+#include "mapped_file.h"
+#include "../common/instrumentation.h"
+
 using std::string;
 using std::vector;
 using std::pair;
@@ -15,13 +29,18 @@ static char kInputFile3[] = "convex_poly_input_3.txt";
 
 typedef vector<pair<double, double>> pair_vect;
 
+INSTR_COUNTER(exact_orientations, "polygon_exact_orientation_fallbacks");
+INSTR_COUNTER(hull_points, "polygon_hull_input_points");
+INSTR_COUNTER(batch_polygons, "polygon_batch_polygons");
+INSTR_TIMER(hull_timer, "polygon_convex_hull");
+
 static int kPointDimension = 2;
 
-void print_pair(pair<double, double> in_pair){
-  printf("(%f, %f)\n", in_pair.first, in_pair.second);
+void print_pair(pair<double, double> in_pair, string* out) {
+  appendf(out, "(%f, %f)\n", in_pair.first, in_pair.second);
 }
 
-vector<vector<double>> parse_csv(std::ifstream* in_file) {
+vector<vector<double>> parse_csv(std::istream* in_file) {
   vector<vector<double>> output;
   int n_lines;
   string line;
@@ -61,84 +80,833 @@ pair_vect to_pair_vect(const vector<vector<double>>& in_vect) {
   return output;
 }
 
-class CClockwiseCompFunctor {
-public:
-  CClockwiseCompFunctor(pair<double, double> center) {
-    center_ = center;
+// Error free transformations used by the exact orientation test
+inline void two_sum(double a, double b, double* sum, double* err) {
+  *sum = a + b;
+  double b_virtual = *sum - a;
+  double a_virtual = *sum - b_virtual;
+  *err = (a - a_virtual) + (b - b_virtual);
+}
+
+inline void two_product(double a, double b, double* prod, double* err) {
+  *prod = a * b;
+  *err = std::fma(a, b, -*prod);
+}
+
+// Sign of the exact value of sum(terms). Grows a nonoverlapping
+// expansion one term at a time (Shewchuk's Grow-Expansion); the most
+// significant nonzero component carries the sign.
+int exact_sign_of_sum(const double* terms, int n_terms) {
+  double expansion[16];
+  int n_components = 0;
+  for (int t = 0; t < n_terms; ++t) {
+    double carry = terms[t];
+    for (int i = 0; i < n_components; ++i)
+      two_sum(carry, expansion[i], &carry, &expansion[i]);
+    expansion[n_components++] = carry;
+  }
+  for (int i = n_components - 1; i >= 0; --i) {
+    if (expansion[i] != 0)
+      return expansion[i] > 0 ? 1 : -1;
   }
+  return 0;
+}
 
-  bool operator() (pair<double, double> p1,
-		   pair<double, double> p2) {
-    return poly_angle(p1) < poly_angle(p2);
+// Returns 1 if a, b, c turn counter clockwise, -1 if clockwise and 0
+// if they are collinear. The fast floating point determinant is used
+// when its error bound proves the sign; otherwise the determinant is
+// evaluated exactly from its six products.
+int orientation(const pair<double, double>& a, const pair<double, double>& b,
+                const pair<double, double>& c) {
+  static const double kErrBound = 3.3306690738754716e-16;
+  double det_left = (a.first - c.first) * (b.second - c.second);
+  double det_right = (a.second - c.second) * (b.first - c.first);
+  double det = det_left - det_right;
+  double bound = kErrBound * (std::fabs(det_left) + std::fabs(det_right));
+  if (det > bound)
+    return 1;
+  if (-det > bound)
+    return -1;
+  if (bound == 0)
+    return 0;
+  INSTR_COUNT(exact_orientations, 1);
+  // det = ax*by - ay*bx + bx*cy - by*cx + cx*ay - cy*ax
+  double terms[12];
+  two_product(a.first, b.second, &terms[0], &terms[1]);
+  two_product(-a.second, b.first, &terms[2], &terms[3]);
+  two_product(b.first, c.second, &terms[4], &terms[5]);
+  two_product(-b.second, c.first, &terms[6], &terms[7]);
+  two_product(c.first, a.second, &terms[8], &terms[9]);
+  two_product(-c.second, a.first, &terms[10], &terms[11]);
+  return exact_sign_of_sum(terms, 12);
+}
+
+// Andrew's monotone chain. Returns the hull of the points in counter
+// clockwise order without collinear vertices. in_points is sorted in
+// place.
+pair_vect monotone_chain(pair_vect* in_points) {
+  pair_vect& points = *in_points;
+  std::sort(points.begin(), points.end());
+  points.erase(std::unique(points.begin(), points.end()), points.end());
+  if (points.size() < 3)
+    return points;
+  pair_vect hull(2 * points.size());
+  size_t k = 0;
+  // Lower hull
+  for (size_t i = 0; i < points.size(); ++i) {
+    while (k >= 2 && orientation(hull[k-2], hull[k-1], points[i]) <= 0)
+      --k;
+    hull[k++] = points[i];
+  }
+  // Upper hull
+  for (size_t i = points.size() - 1, lower_size = k + 1; i > 0; --i) {
+    while (k >= lower_size &&
+           orientation(hull[k-2], hull[k-1], points[i-1]) <= 0)
+      --k;
+    hull[k++] = points[i-1];
   }
+  // The last point repeats the first one
+  hull.resize(k - 1);
+  return hull;
+}
 
-private:
-  double poly_angle(pair<double, double> point) {
-    return std::atan2(point.second - center_.second, 
-		      point.first - center_.first);
+// Convex hull of an arbitrary point cloud. Large clouds are split into
+// one slice per thread, each slice is reduced to its own hull in
+// parallel and the hull of the union of those hulls is the answer.
+pair_vect convex_hull(pair_vect points, int n_threads) {
+  INSTR_SCOPED_TIMER(hull_timer);
+  INSTR_COUNT(hull_points, points.size());
+  static const size_t kMinPointsPerThread = 1 << 16;
+  size_t n_slices = std::min<size_t>(
+      n_threads, points.size() / kMinPointsPerThread);
+  if (n_slices <= 1)
+    return monotone_chain(&points);
+  vector<pair_vect> slice_hulls(n_slices);
+  vector<std::thread> workers;
+  for (size_t i = 0; i < n_slices; ++i) {
+    workers.emplace_back([&, i]() {
+      pair_vect slice(points.begin() + points.size() * i / n_slices,
+                      points.begin() + points.size() * (i + 1) / n_slices);
+      slice_hulls[i] = monotone_chain(&slice);
+    });
   }
+  for (auto& worker : workers)
+    worker.join();
+  pair_vect merged;
+  for (const auto& slice_hull : slice_hulls)
+    merged.insert(merged.end(), slice_hull.cbegin(), slice_hull.cend());
+  return monotone_chain(&merged);
+}
 
-  pair<double, double> center_;
-};
-  
 
+// Convex polygon spanned by a set of points. The points do not need to
+// be ordered or even convex; the polygon is their convex hull, stored
+// counter clockwise.
 class ConvexPolygon {
 public:
-  ConvexPolygon(const pair_vect& in_points) {
-    points_ = in_points;
-    calc_center();
-    std::sort(points_.begin(), points_.end(), 
-	      CClockwiseCompFunctor(center_));
+  explicit ConvexPolygon(const pair_vect& in_points, int n_threads = 1) {
+    points_ = convex_hull(in_points, n_threads);
     calc_area();
   }
   
   double area () const { return area_; }
+  const pair_vect& points() const { return points_; }
+
+  // Point in polygon test in O(log n). Binary searches the fan of
+  // triangles around points_[0] for the wedge holding the point, then
+  // tests the one hull edge closing that wedge. Boundary points count
+  // as inside.
+  bool contains(const pair<double, double>& point) const {
+    size_t n = points_.size();
+    if (n < 3)
+      return false;
+    const pair<double, double>& origin = points_[0];
+    if (orientation(origin, points_[1], point) < 0 ||
+        orientation(origin, points_[n-1], point) > 0)
+      return false;
+    size_t lo = 1;
+    size_t hi = n - 2;
+    while (lo < hi) {
+      size_t mid = (lo + hi + 1) / 2;
+      if (orientation(origin, points_[mid], point) >= 0)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    return orientation(points_[lo], points_[lo+1], point) >= 0;
+  }
+
+  // Tests many points at once, setting inside[i] to 1 when (xs[i], ys[i])
+  // is in the polygon. Small polygons are tested edge by edge against
+  // all points with plain floating point half plane checks, a loop the
+  // compiler vectorizes; larger ones fall back to contains() per point.
+  void contains_points(const vector<double>& xs, const vector<double>& ys,
+                       vector<uint8_t>* inside, int n_threads = 1) const {
+    static const size_t kMaxHalfPlaneEdges = 32;
+    size_t n_points = xs.size();
+    inside->assign(n_points, points_.size() >= 3 ? 1 : 0);
+    if (points_.size() < 3)
+      return;
+    vector<std::thread> workers;
+    for (int t = 0; t < n_threads; ++t) {
+      size_t begin = n_points * t / n_threads;
+      size_t end = n_points * (t + 1) / n_threads;
+      workers.emplace_back([&, begin, end]() {
+        uint8_t* out = inside->data();
+        if (points_.size() > kMaxHalfPlaneEdges) {
+          for (size_t i = begin; i < end; ++i)
+            out[i] = contains(std::make_pair(xs[i], ys[i]));
+          return;
+        }
+        for (size_t e = 0; e < points_.size(); ++e) {
+          const auto& a = points_[e];
+          const auto& b = points_[(e + 1) % points_.size()];
+          double coef_x = a.second - b.second;
+          double coef_y = b.first - a.first;
+          double offset = -(coef_x * a.first + coef_y * a.second);
+          for (size_t i = begin; i < end; ++i)
+            out[i] &= (coef_x * xs[i] + coef_y * ys[i] + offset) >= 0;
+        }
+      });
+    }
+    for (auto& worker : workers)
+      worker.join();
+  }
+
+  // Sutherland-Hodgman: clips this polygon against each edge of other.
+  // Both are convex, so the result is the exact intersection region.
+  ConvexPolygon intersection(const ConvexPolygon& other) const {
+    pair_vect clipped = points_;
+    const pair_vect& clip = other.points_;
+    for (size_t e = 0; e < clip.size() && !clipped.empty(); ++e) {
+      const auto& a = clip[e];
+      const auto& b = clip[(e + 1) % clip.size()];
+      pair_vect input;
+      input.swap(clipped);
+      for (size_t i = 0; i < input.size(); ++i) {
+        const auto& cur = input[i];
+        const auto& prev = input[(i + input.size() - 1) % input.size()];
+        bool cur_in = orientation(a, b, cur) >= 0;
+        bool prev_in = orientation(a, b, prev) >= 0;
+        if (cur_in != prev_in)
+          clipped.push_back(line_intersection(prev, cur, a, b));
+        if (cur_in)
+          clipped.push_back(cur);
+      }
+    }
+    return ConvexPolygon(clipped);
+  }
+
+  double intersection_area(const ConvexPolygon& other) const {
+    return intersection(other).area();
+  }
+
+  // True if the segment a-b shares at least one point with the
+  // polygon. Unless an end point is inside, the segment has to meet
+  // one of the hull edges.
+  bool intersects_segment(const pair<double, double>& a,
+                          const pair<double, double>& b) const {
+    if (contains(a) || contains(b))
+      return true;
+    for (size_t e = 0; e < points_.size(); ++e) {
+      if (segments_meet(a, b, points_[e],
+                        points_[(e + 1) % points_.size()]))
+        return true;
+    }
+    return false;
+  }
+
 private:
+  // Whether segments p-q and a-b share a point, touching included
+  static bool segments_meet(
+      const pair<double, double>& p, const pair<double, double>& q,
+      const pair<double, double>& a, const pair<double, double>& b) {
+    int side_p = orientation(a, b, p);
+    int side_q = orientation(a, b, q);
+    int side_a = orientation(p, q, a);
+    int side_b = orientation(p, q, b);
+    if (side_p * side_q < 0 && side_a * side_b < 0)
+      return true;
+    // Collinear end points only count when they lie on the other
+    // segment's extent
+    auto on_segment = [](const pair<double, double>& u,
+                         const pair<double, double>& v,
+                         const pair<double, double>& w) {
+      return std::min(u.first, v.first) <= w.first &&
+          w.first <= std::max(u.first, v.first) &&
+          std::min(u.second, v.second) <= w.second &&
+          w.second <= std::max(u.second, v.second);
+    };
+    return (side_p == 0 && on_segment(a, b, p)) ||
+        (side_q == 0 && on_segment(a, b, q)) ||
+        (side_a == 0 && on_segment(p, q, a)) ||
+        (side_b == 0 && on_segment(p, q, b));
+  }
+
+  // Point where segment p-q crosses the line through a and b. Only
+  // called when p and q are on opposite sides of that line.
+  static pair<double, double> line_intersection(
+      const pair<double, double>& p, const pair<double, double>& q,
+      const pair<double, double>& a, const pair<double, double>& b) {
+    double edge_x = b.first - a.first;
+    double edge_y = b.second - a.second;
+    double side_p = edge_x * (p.second - a.second) -
+        edge_y * (p.first - a.first);
+    double side_q = edge_x * (q.second - a.second) -
+        edge_y * (q.first - a.first);
+    double t = side_p / (side_p - side_q);
+    return std::make_pair(p.first + t * (q.first - p.first),
+                          p.second + t * (q.second - p.second));
+  }
+
+  // Shoelace formula over the hull vertices
   void calc_area() {
     area_ = 0.0;
-    for (auto it = points_.cbegin(); it != --points_.cend(); ++it) {
-      auto next = it + 1;
-      area_ += (it->first * next->second) - (it->second * next->first);
-    }
-    if (points_.size() > 1) {
-      auto sec2last = --points_.cend();
-      auto first = points_.cbegin();
-      area_ += (sec2last->first * first->second) - (sec2last->second * first->first);
+    for (size_t i = 0, j = points_.size() - 1; i < points_.size(); j = i++) {
+      area_ += (points_[j].first * points_[i].second) -
+          (points_[j].second * points_[i].first);
     }
     area_ *= 0.5;
   }
-  
-  void calc_center() {
-    center_ = std::make_pair(0, 0);
-    for (const auto& point : points_) {
-      center_.first += point.first;
-      center_.second += point.second;
-    }
-    center_.first = center_.first/points_.size();
-    center_.second = center_.second/points_.size();
-  }
 
   pair_vect points_;
-  pair<double, double> center_;
   double area_;
 };
 
+// Many polygons in struct-of-arrays form. The vertices of polygon k
+// are x[offsets[k]] .. x[offsets[k+1]-1] (same for y), in boundary
+// order. Unlike ConvexPolygon no hull is taken, so the vertices must
+// already be ordered.
+struct PolygonBatch {
+  vector<double> x;
+  vector<double> y;
+  vector<size_t> offsets;
+
+  size_t n_polygons() const { return offsets.size() - 1; }
+};
+
+// Parses a stream of polygons in the single polygon file format, one
+// after the other: a vertex count line followed by that many "x,y"
+// lines. Numbers are read in place from the mapped file.
+bool parse_polygon_batch(const MappedFile& in_file, PolygonBatch* batch) {
+  const char* cur = in_file.data();
+  const char* end = cur + in_file.size();
+  auto skip_space = [&]() {
+    while (cur < end && (*cur == ' ' || *cur == '\t' ||
+                         *cur == '\r' || *cur == '\n'))
+      ++cur;
+  };
+  auto read_double = [&](double* value) {
+    skip_space();
+    auto result = std::from_chars(cur, end, *value);
+    if (result.ec != std::errc())
+      return false;
+    cur = result.ptr;
+    if (cur < end && *cur == ',')
+      ++cur;
+    return true;
+  };
+  batch->offsets.assign(1, 0);
+  skip_space();
+  while (cur < end) {
+    size_t n_points;
+    auto result = std::from_chars(cur, end, n_points);
+    if (result.ec != std::errc())
+      return false;
+    cur = result.ptr;
+    for (size_t i = 0; i < n_points; ++i) {
+      double x, y;
+      if (!read_double(&x) || !read_double(&y))
+        return false;
+      batch->x.push_back(x);
+      batch->y.push_back(y);
+    }
+    batch->offsets.push_back(batch->x.size());
+    skip_space();
+  }
+  return true;
+}
+
+// Shoelace sum over the vertices [begin, end), taken relative to the
+// first vertex so a polygon far from the origin does not cancel its
+// own area away. Each cross term is formed exactly with two_product
+// and every rounding error goes into a compensation term, so the sum
+// is as accurate as in twice the precision and the vector and scalar
+// loops agree. use_simd = false forces the scalar loop.
+double shoelace_area(const double* x, const double* y,
+                     size_t begin, size_t end, bool use_simd = true) {
+  if (end - begin < 3)
+    return 0.0;
+  size_t last = end - 1;
+  double x0 = x[begin];
+  double y0 = y[begin];
+  double sum = 0.0;
+  double comp = 0.0;
+  // Edges touching the first vertex have no cross term
+  size_t i = begin + 1;
+#if defined(__AVX2__) && defined(__FMA__)
+  if (use_simd) {
+    __m256d x0_v = _mm256_set1_pd(x0);
+    __m256d y0_v = _mm256_set1_pd(y0);
+    __m256d sum_v = _mm256_setzero_pd();
+    __m256d comp_v = _mm256_setzero_pd();
+    // Two sum of a and b: returns a + b, *err gets the rounding error
+    auto two_sum_v = [](__m256d a, __m256d b, __m256d* err) {
+      __m256d s = _mm256_add_pd(a, b);
+      __m256d b_virtual = _mm256_sub_pd(s, a);
+      __m256d a_virtual = _mm256_sub_pd(s, b_virtual);
+      *err = _mm256_add_pd(_mm256_sub_pd(a, a_virtual),
+                           _mm256_sub_pd(b, b_virtual));
+      return s;
+    };
+    for (; i + 4 <= last; i += 4) {
+      __m256d dx0 = _mm256_sub_pd(_mm256_loadu_pd(x + i), x0_v);
+      __m256d dy0 = _mm256_sub_pd(_mm256_loadu_pd(y + i), y0_v);
+      __m256d dx1 = _mm256_sub_pd(_mm256_loadu_pd(x + i + 1), x0_v);
+      __m256d dy1 = _mm256_sub_pd(_mm256_loadu_pd(y + i + 1), y0_v);
+      __m256d left = _mm256_mul_pd(dx0, dy1);
+      __m256d left_err = _mm256_fmsub_pd(dx0, dy1, left);
+      __m256d right = _mm256_mul_pd(dy0, dx1);
+      __m256d right_err = _mm256_fmsub_pd(dy0, dx1, right);
+      __m256d cross_err, sum_err;
+      __m256d cross = two_sum_v(left, _mm256_sub_pd(_mm256_setzero_pd(),
+                                                    right), &cross_err);
+      sum_v = two_sum_v(sum_v, cross, &sum_err);
+      comp_v = _mm256_add_pd(comp_v, _mm256_add_pd(
+          _mm256_add_pd(sum_err, cross_err),
+          _mm256_sub_pd(left_err, right_err)));
+    }
+    alignas(32) double lane_sums[4];
+    alignas(32) double lane_comps[4];
+    _mm256_store_pd(lane_sums, sum_v);
+    _mm256_store_pd(lane_comps, comp_v);
+    for (int lane = 0; lane < 4; ++lane) {
+      double err;
+      two_sum(sum, lane_sums[lane], &sum, &err);
+      comp += err + lane_comps[lane];
+    }
+  }
+#else
+  (void)use_simd;
+#endif
+  for (; i < last; ++i) {
+    double dx0 = x[i] - x0;
+    double dy0 = y[i] - y0;
+    double dx1 = x[i+1] - x0;
+    double dy1 = y[i+1] - y0;
+    double left, left_err, right, right_err, cross, cross_err, sum_err;
+    two_product(dx0, dy1, &left, &left_err);
+    two_product(dy0, dx1, &right, &right_err);
+    two_sum(left, -right, &cross, &cross_err);
+    two_sum(sum, cross, &sum, &sum_err);
+    comp += sum_err + cross_err + left_err - right_err;
+  }
+  return std::fabs(0.5 * (sum + comp));
+}
+
+// Fills areas with one entry per polygon. Polygons are split into
+// n_threads ranges holding about the same number of vertices.
+void batch_areas(const PolygonBatch& batch, int n_threads,
+                 vector<double>* areas) {
+  size_t n_polygons = batch.n_polygons();
+  INSTR_COUNT(batch_polygons, n_polygons);
+  areas->resize(n_polygons);
+  vector<size_t> bounds(1, 0);
+  for (int t = 1; t < n_threads; ++t) {
+    size_t target = batch.x.size() * t / n_threads;
+    bounds.push_back(std::lower_bound(batch.offsets.cbegin() + bounds.back(),
+                                      batch.offsets.cend() - 1, target) -
+                     batch.offsets.cbegin());
+  }
+  bounds.push_back(n_polygons);
+  vector<std::thread> workers;
+  for (int t = 0; t < n_threads; ++t) {
+    workers.emplace_back([&, t]() {
+      for (size_t k = bounds[t]; k < bounds[t+1]; ++k) {
+        (*areas)[k] = shoelace_area(batch.x.data(), batch.y.data(),
+                                    batch.offsets[k], batch.offsets[k+1]);
+      }
+    });
+  }
+  for (auto& worker : workers)
+    worker.join();
+}
+
+// Computes and prints the areas of every polygon in one batch file
+int run_batch(const string& file_name, int n_threads) {
+  static const size_t kMaxPrinted = 10;
+  MappedFile in_file(file_name);
+  PolygonBatch batch;
+  if (!in_file.is_open() || !parse_polygon_batch(in_file, &batch)) {
+    printf("Error reading polygon batch %s\n", file_name.c_str());
+    return -1;
+  }
+  auto start = std::chrono::steady_clock::now();
+  vector<double> areas;
+  batch_areas(batch, n_threads, &areas);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  for (size_t k = 0; k < std::min(areas.size(), kMaxPrinted); ++k)
+    printf("Polygon %zu Area: %f\n", k, areas[k]);
+  printf("Polygons: %zu\tVertices: %zu\n", areas.size(), batch.x.size());
+  printf("Polygons per second: %.0f\n", areas.size() / elapsed.count());
+  return 0;
+}
+
+// Axis aligned bounding box. Two boxes fill one 64 byte cache line.
+struct alignas(32) Box {
+  double min_x;
+  double min_y;
+  double max_x;
+  double max_y;
+
+  bool contains(const pair<double, double>& point) const {
+    return point.first >= min_x && point.first <= max_x &&
+        point.second >= min_y && point.second <= max_y;
+  }
+  bool overlaps(const Box& other) const {
+    return min_x <= other.max_x && other.min_x <= max_x &&
+        min_y <= other.max_y && other.min_y <= max_y;
+  }
+  void expand(const Box& other) {
+    min_x = std::min(min_x, other.min_x);
+    min_y = std::min(min_y, other.min_y);
+    max_x = std::max(max_x, other.max_x);
+    max_y = std::max(max_y, other.max_y);
+  }
+};
+
+Box bounding_box(const ConvexPolygon& polygon) {
+  Box box = {std::numeric_limits<double>::infinity(),
+             std::numeric_limits<double>::infinity(),
+             -std::numeric_limits<double>::infinity(),
+             -std::numeric_limits<double>::infinity()};
+  for (const auto& point : polygon.points()) {
+    box.min_x = std::min(box.min_x, point.first);
+    box.min_y = std::min(box.min_y, point.second);
+    box.max_x = std::max(box.max_x, point.first);
+    box.max_y = std::max(box.max_y, point.second);
+  }
+  return box;
+}
+
+// Static R-tree over the bounding boxes of a set of polygons, bulk
+// loaded with Sort-Tile-Recursive packing. All levels live in one flat
+// array, leaves first; the children of node i on one level are entries
+// [i*kFanout, (i+1)*kFanout) of the level below, so a node's children
+// are contiguous and no pointers are stored. Box hits are confirmed
+// with the exact polygon tests before being reported. The tree keeps
+// a pointer to the polygons, so they must outlive it.
+class PolygonRTree {
+ public:
+  static const int kFanout = 16;
+
+  explicit PolygonRTree(const vector<ConvexPolygon>* polygons)
+      : polygons_(polygons) {
+    vector<pair<Box, int>> entries;
+    for (size_t i = 0; i < polygons->size(); ++i) {
+      if ((*polygons)[i].points().empty())
+        continue;
+      entries.push_back(std::make_pair(bounding_box((*polygons)[i]), i));
+    }
+    str_pack(&entries);
+    for (const auto& entry : entries) {
+      boxes_.push_back(entry.first);
+      polygon_ids_.push_back(entry.second);
+    }
+    level_begin_.push_back(0);
+    size_t level_size = boxes_.size();
+    // Each parent level is the packed boxes of the level below
+    while (level_size > 1) {
+      size_t child_begin = level_begin_.back();
+      level_begin_.push_back(boxes_.size());
+      for (size_t i = 0; i < level_size; i += kFanout) {
+        Box parent = boxes_[child_begin + i];
+        size_t end = std::min(level_size, i + kFanout);
+        for (size_t c = i + 1; c < end; ++c)
+          parent.expand(boxes_[child_begin + c]);
+        boxes_.push_back(parent);
+      }
+      level_size = boxes_.size() - level_begin_.back();
+    }
+  }
+
+  // Indices of the polygons containing point
+  void query_point(const pair<double, double>& point,
+                   vector<int>* hits) const {
+    search([&](const Box& box) { return box.contains(point); },
+           [&](int id) { return (*polygons_)[id].contains(point); }, hits);
+  }
+
+  // Indices of the polygons sharing at least one point with box. A box
+  // with no area would be a degenerate clip region that keeps every
+  // point, so points and segments get their own exact tests.
+  void query_box(const Box& box, vector<int>* hits) const {
+    auto overlaps = [&](const Box& node) { return node.overlaps(box); };
+    pair<double, double> low = std::make_pair(box.min_x, box.min_y);
+    pair<double, double> high = std::make_pair(box.max_x, box.max_y);
+    if (box.min_x == box.max_x && box.min_y == box.max_y) {
+      search(overlaps,
+             [&](int id) { return (*polygons_)[id].contains(low); }, hits);
+      return;
+    }
+    if (box.min_x == box.max_x || box.min_y == box.max_y) {
+      search(overlaps, [&](int id) {
+               return (*polygons_)[id].intersects_segment(low, high);
+             }, hits);
+      return;
+    }
+    ConvexPolygon box_polygon({{box.min_x, box.min_y},
+                               {box.max_x, box.min_y},
+                               {box.max_x, box.max_y},
+                               {box.min_x, box.max_y}});
+    search(overlaps,
+           [&](int id) {
+             const ConvexPolygon& polygon = (*polygons_)[id];
+             return !polygon.intersection(box_polygon).points().empty();
+           }, hits);
+  }
+
+  // Answers one point query per entry of points on n_threads workers
+  void query_points(const pair_vect& points, int n_threads,
+                    vector<vector<int>>* hits) const {
+    hits->assign(points.size(), vector<int>());
+    vector<std::thread> workers;
+    for (int t = 0; t < n_threads; ++t) {
+      workers.emplace_back([&, t]() {
+        size_t end = points.size() * (t + 1) / n_threads;
+        for (size_t i = points.size() * t / n_threads; i < end; ++i)
+          query_point(points[i], &(*hits)[i]);
+      });
+    }
+    for (auto& worker : workers)
+      worker.join();
+  }
+
+ private:
+  // Sort-Tile-Recursive: sort by x, cut into vertical slabs of about
+  // sqrt(n / kFanout) leaves each, then sort every slab by y
+  static void str_pack(vector<pair<Box, int>>* entries) {
+    auto center_x = [](const pair<Box, int>& entry) {
+      return entry.first.min_x + entry.first.max_x;
+    };
+    auto center_y = [](const pair<Box, int>& entry) {
+      return entry.first.min_y + entry.first.max_y;
+    };
+    std::sort(entries->begin(), entries->end(),
+              [&](const pair<Box, int>& lhs, const pair<Box, int>& rhs) {
+                return center_x(lhs) < center_x(rhs);
+              });
+    size_t n_leaves = (entries->size() + kFanout - 1) / kFanout;
+    size_t n_slabs = std::ceil(std::sqrt(static_cast<double>(n_leaves)));
+    size_t slab_size = std::max<size_t>(1, n_slabs) * kFanout;
+    for (size_t begin = 0; begin < entries->size(); begin += slab_size) {
+      size_t end = std::min(entries->size(), begin + slab_size);
+      std::sort(entries->begin() + begin, entries->begin() + end,
+                [&](const pair<Box, int>& lhs, const pair<Box, int>& rhs) {
+                  return center_y(lhs) < center_y(rhs);
+                });
+    }
+  }
+
+  template <typename BoxTest, typename ExactTest>
+  void search(BoxTest box_test, ExactTest exact_test,
+              vector<int>* hits) const {
+    if (boxes_.empty())
+      return;
+    // Stack of (level, index within level)
+    vector<pair<int, size_t>> stack;
+    stack.push_back(std::make_pair(level_begin_.size() - 1, 0));
+    while (!stack.empty()) {
+      pair<int, size_t> node = stack.back();
+      stack.pop_back();
+      if (!box_test(boxes_[level_begin_[node.first] + node.second]))
+        continue;
+      if (node.first == 0) {
+        int id = polygon_ids_[node.second];
+        if (exact_test(id))
+          hits->push_back(id);
+        continue;
+      }
+      size_t child_level_size = level_begin_[node.first] -
+          level_begin_[node.first - 1];
+      size_t end = std::min(child_level_size,
+                            (node.second + 1) * kFanout);
+      for (size_t c = node.second * kFanout; c < end; ++c)
+        stack.push_back(std::make_pair(node.first - 1, c));
+    }
+  }
+
+  const vector<ConvexPolygon>* polygons_;
+  vector<Box> boxes_;
+  vector<int> polygon_ids_;
+  vector<size_t> level_begin_;
+};
+
+// Times PolygonRTree point queries against a linear scan over random
+// polygons and checks that both find the same polygons.
+int run_rtree_bench(int n_polygons, int n_queries, int n_threads) {
+  std::mt19937 gen(169);
+  std::uniform_real_distribution<double> coord(0.0, 1000.0);
+  std::uniform_real_distribution<double> offset(-2.0, 2.0);
+  vector<ConvexPolygon> polygons;
+  polygons.reserve(n_polygons);
+  for (int i = 0; i < n_polygons; ++i) {
+    double cx = coord(gen);
+    double cy = coord(gen);
+    pair_vect points;
+    for (int p = 0; p < 8; ++p)
+      points.push_back(std::make_pair(cx + offset(gen), cy + offset(gen)));
+    polygons.push_back(ConvexPolygon(points));
+  }
+  pair_vect queries;
+  for (int i = 0; i < n_queries; ++i)
+    queries.push_back(std::make_pair(coord(gen), coord(gen)));
+
+  auto start = std::chrono::steady_clock::now();
+  PolygonRTree tree(&polygons);
+  auto built = std::chrono::steady_clock::now();
+  vector<vector<int>> tree_hits;
+  tree.query_points(queries, n_threads, &tree_hits);
+  auto queried = std::chrono::steady_clock::now();
+  vector<vector<int>> brute_hits(queries.size());
+  for (size_t q = 0; q < queries.size(); ++q) {
+    for (int i = 0; i < n_polygons; ++i) {
+      if (polygons[i].contains(queries[q]))
+        brute_hits[q].push_back(i);
+    }
+  }
+  auto scanned = std::chrono::steady_clock::now();
+
+  size_t mismatches = 0;
+  size_t total_hits = 0;
+  for (size_t q = 0; q < queries.size(); ++q) {
+    std::sort(tree_hits[q].begin(), tree_hits[q].end());
+    mismatches += tree_hits[q] != brute_hits[q];
+    total_hits += brute_hits[q].size();
+  }
+  std::chrono::duration<double> build_time = built - start;
+  std::chrono::duration<double> tree_time = queried - built;
+  std::chrono::duration<double> brute_time = scanned - queried;
+  printf("Polygons: %d\tQueries: %d\tHits: %zu\n",
+         n_polygons, n_queries, total_hits);
+  printf("R-tree build: %f s\tquery: %f s\n",
+         build_time.count(), tree_time.count());
+  printf("Brute force: %f s\n", brute_time.count());
+  printf("Mismatches: %zu\n", mismatches);
+  return mismatches == 0 ? 0 : -1;
+}
+
+// Known answers for the corner cases of the polygon tests. Prints
+// every failed check and returns -1 if there were any.
+int run_checks() {
+  int n_failed = 0;
+  auto check = [&](bool ok, const char* what) {
+    if (!ok) {
+      printf("Check failed: %s\n", what);
+      ++n_failed;
+    }
+  };
+  vector<ConvexPolygon> polygons;
+  polygons.push_back(ConvexPolygon({{0, 0}, {10, 0}, {0, 10}}));
+  polygons.push_back(ConvexPolygon({{20, 20}, {30, 20}, {30, 30}, {20, 30}}));
+  PolygonRTree tree(&polygons);
+  auto box_hits = [&](double min_x, double min_y, double max_x,
+                      double max_y) {
+    vector<int> hits;
+    tree.query_box(Box{min_x, min_y, max_x, max_y}, &hits);
+    std::sort(hits.begin(), hits.end());
+    return hits;
+  };
+  // Points and segments are boxes without area
+  check(box_hits(9, 9, 9, 9).empty(), "point outside the triangle");
+  check(box_hits(2, 2, 2, 2) == vector<int>{0}, "point inside the triangle");
+  check(box_hits(5, 5, 5, 5) == vector<int>{0}, "point on the hypotenuse");
+  check(box_hits(25, 25, 25, 25) == vector<int>{1}, "point in the square");
+  check(box_hits(8, 8, 8, 12).empty(), "segment past the triangle");
+  check(box_hits(2, -5, 2, 3) == vector<int>{0}, "segment into the triangle");
+  check(box_hits(-5, 2, 25, 2) == vector<int>{0},
+        "segment across the triangle");
+  check(box_hits(10, -5, 10, 0) == vector<int>{0}, "segment to a vertex");
+  check(box_hits(0, 25, 40, 25) == vector<int>{1}, "segment across the square");
+  check(box_hits(4, 4, 21, 21) == (vector<int>{0, 1}), "box over both");
+  check(box_hits(8, 8, 12, 12).empty(), "box past the triangle");
+  // Unit regular polygons far from the origin, where a plain shoelace
+  // sum cancels most of the area away
+  static const double kPi = 3.14159265358979323846;
+  for (int n : {5, 12, 64}) {
+    PolygonBatch batch;
+    batch.offsets.assign(1, 0);
+    for (int k = 0; k < n; ++k) {
+      batch.x.push_back(1e6 + std::cos(2 * kPi * k / n));
+      batch.y.push_back(1e6 + std::sin(2 * kPi * k / n));
+    }
+    batch.offsets.push_back(n);
+    double expected = 0.5 * n * std::sin(2 * kPi / n);
+    double simd = shoelace_area(batch.x.data(), batch.y.data(), 0, n);
+    double scalar = shoelace_area(batch.x.data(), batch.y.data(), 0, n,
+                                  false);
+    check(std::fabs(scalar - expected) < 1e-8, "area far from the origin");
+    check(std::fabs(simd - scalar) <= 1e-14 * scalar,
+          "vector and scalar areas agree");
+  }
+  printf("Checks failed: %d\n", n_failed);
+  return n_failed == 0 ? 0 : -1;
+}
+
+// Reads the polygon in in_file and appends its points and area to out
+ConvexPolygon solve_polygon(const string& file_name, std::istream* in_file,
+                            string* out, int n_threads) {
+  pair_vect points = to_pair_vect(parse_csv(in_file));
+  appendf(out, "File: %s\nPoints:\n", file_name.c_str());
+  for (const auto& point : points)
+    print_pair(point, out);
+  ConvexPolygon cur_poly(points, n_threads);
+  appendf(out, "Area: %f\n", cur_poly.area());
+  appendf(out, "\n");
+  return cur_poly;
+}
+
+// Usage: convex_polygon_area [--batch file]
+//                            [--files directory_or_glob]
+//                            [--rtree-bench n_polygons n_queries]
+//                            [--check]
 int main(int argc, char *argv[]) {
+  INSTR_INSTALL_DUMP("convex_polygon_area");
+  int n_threads = std::max(1u, std::thread::hardware_concurrency());
+  if (argc == 3 && string(argv[1]) == "--batch")
+    return run_batch(argv[2], n_threads);
+  // Many polygon files, each solved on one thread of the pool
+  if (argc == 3 && string(argv[1]) == "--files") {
+    return run_batch_files(argv[2], n_threads,
+                           [](const string& file_name, const string& contents,
+                              string* out) {
+                             std::istringstream in_file(contents);
+                             solve_polygon(file_name, &in_file, out, 1);
+                           });
+  }
+  if (argc == 2 && string(argv[1]) == "--check")
+    return run_checks();
+  if (argc == 4 && string(argv[1]) == "--rtree-bench")
+    return run_rtree_bench(std::atoi(argv[2]), std::atoi(argv[3]),
+                           n_threads);
   vector<string> file_strings = {kInputFile1,
                                  kInputFile2,
                                  kInputFile3};
+  vector<ConvexPolygon> polygons;
   for (auto iter = file_strings.cbegin();
        iter < file_strings.cend(); ++iter) {
     std::ifstream in_file(*iter);
     if (in_file) {
-      pair_vect points = to_pair_vect(parse_csv(&in_file));
-      printf("File: %s\nPoints:\n", iter->c_str());
-      std::for_each(points.cbegin(), points.cend(), print_pair);
-      ConvexPolygon cur_poly(points);
-      printf("Area: %f\n", cur_poly.area());
-      printf("\n");
+      string report;
+      polygons.push_back(solve_polygon(*iter, &in_file, &report, n_threads));
+      fputs(report.c_str(), stdout);
     }
     in_file.close();
   }
+  for (size_t i = 0; i + 1 < polygons.size(); ++i) {
+    printf("Intersection area of polygons %zu and %zu: %f\n", i + 1, i + 2,
+           polygons[i].intersection_area(polygons[i+1]));
+  }
   return 0;
 }
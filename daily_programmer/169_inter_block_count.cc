@@ -1,8 +1,17 @@
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
-#include <unordered_map>
+
+#include "../common/instrumentation.h"
 
 using std::vector;
 using std::string;
@@ -10,25 +19,83 @@ using std::string;
 static char kInputFileName[] = "ASCIIMap.txt";
 static int kBlockLength = 10;
 
+INSTR_COUNTER(cells_visited, "block_count_cells_visited");
+INSTR_COUNTER(border_cells_stitched, "block_count_border_cells_stitched");
+INSTR_COUNTER(edit_cells_reflooded, "block_count_edit_cells_reflooded");
+INSTR_TIMER(block_count_timer, "block_count");
+
+// Hands out the lines of a file one at a time. The file is read in
+// large blocks with fread and lines are found with memchr, which glibc
+// implements with vector instructions. A returned row stays valid
+// until the next call to next_row.
+class RowReader {
+public:
+  explicit RowReader(FILE* p_file)
+      : p_file_(p_file), buffer_(kBufferSize), begin_(0), end_(0) {}
+
+  bool next_row(const char** row, int* length) {
+    while (true) {
+      const char* start = buffer_.data() + begin_;
+      const char* newline = static_cast<const char*>(
+	  memchr(start, '\n', end_ - begin_));
+      if (newline != NULL) {
+	*row = start;
+	*length = newline - start;
+	begin_ += *length + 1;
+	return true;
+      }
+      if (!refill()) {
+	// Last line without a trailing newline
+	if (begin_ == end_)
+	  return false;
+	*row = start;
+	*length = end_ - begin_;
+	begin_ = end_;
+	return true;
+      }
+    }
+  }
+
+private:
+  static const size_t kBufferSize = 1 << 20;
+
+  // Moves the unread tail to the front and reads more behind it,
+  // growing the buffer when a single line does not fit
+  bool refill() {
+    if (feof(p_file_) || ferror(p_file_))
+      return false;
+    std::copy(buffer_.begin() + begin_, buffer_.begin() + end_,
+	      buffer_.begin());
+    end_ -= begin_;
+    begin_ = 0;
+    if (end_ == buffer_.size())
+      buffer_.resize(buffer_.size() * 2);
+    end_ += fread(buffer_.data() + end_, 1, buffer_.size() - end_, p_file_);
+    return true;
+  }
+
+  FILE* p_file_;
+  vector<char> buffer_;
+  size_t begin_;
+  size_t end_;
+};
+
+
 class ASCIIMatrix {
 public:
   explicit ASCIIMatrix(FILE* p_file) {
     n_rows_ = 0;
     n_cols_ = 0;
-    int char_count = 0;
-    int ch;
-    while ((ch = fgetc(p_file)) != EOF) {
-      if (ch == '\n') {
-	if (n_cols_ == 0)
-	  n_cols_ = char_count;
-	else if (n_cols_ != char_count)
-	  printf("Error, collumns are not even\n");
-	n_rows_++;
-	char_count = 0;
-      } else {
-	ascii_map_.push_back(ch);
-	char_count++;
-      }
+    RowReader reader(p_file);
+    const char* row;
+    int length;
+    while (reader.next_row(&row, &length)) {
+      if (n_rows_ == 0)
+	n_cols_ = length;
+      else if (n_cols_ != length)
+	printf("Error, collumns are not even\n");
+      ascii_map_.insert(ascii_map_.end(), row, row + length);
+      n_rows_++;
     }
     size_ = n_cols_*n_rows_;
   }
@@ -40,6 +107,11 @@ public:
       return ascii_map_[idx];
   }
 
+  void set_element (int idx, char ch) {
+    if (idx < n_rows_ * n_cols_)
+      ascii_map_[idx] = ch;
+  }
+
   void get_adjacent_idxs (int idx, vector<int>* adj_idx) const {
     int row = idx / n_cols_;
     int col = idx % n_cols_;
@@ -57,6 +129,7 @@ public:
     return n_rows_ * n_cols_;
   }
 
+  const char* data() const { return ascii_map_.data(); }
   int n_rows() const { return n_rows_; }
   int n_cols() const { return n_cols_; }
   int size() const { return size_; }
@@ -68,87 +141,759 @@ private:
 };
 
 
+// 64 bit so that the metrics of very large maps do not overflow
 struct BlockMetrics {
-  int area;
-  int circumference;
-  int number_blobs;
+  long long area;
+  long long circumference;
+  long long number_blobs;
 };
 
 
+static const int kNumChars = 256;
+
+typedef vector<BlockMetrics> MetricsTable;
+
+void print_metrics_table(const MetricsTable& table, bool show_blobs = true) {
+  printf("Block data\n");
+  for (int ch = 0; ch < kNumChars; ++ch) {
+    const BlockMetrics& met = table[ch];
+    if (met.area == 0)
+      continue;
+    if (show_blobs)
+      printf("%c: Area: %lld\tCirc: %lld\tBlobs: %lld\n", 
+	     ch, met.area, met.circumference, met.number_blobs);
+    else
+      printf("%c: Area: %lld\tCirc: %lld\n", 
+	     ch, met.area, met.circumference);
+  }
+}
+
+// Labels connected regions of equal characters with a two pass
+// scanline algorithm. The map is cut into one horizontal stripe per
+// thread. In the first pass each thread walks its stripe row by row,
+// merging each cell with its left and upper neighbour in a union-find
+// forest and accumulating area and circumference into its own flat
+// 256 entry table. The stripes are then stitched together along their
+// borders through the same forest, which is lock free so every border
+// is handled by its own thread. The second pass counts the forest
+// roots to get the blobs, and the per thread tables are summed at the
+// end. Nothing recurses and no memory is allocated per cell.
 class ASCIIBlockCount{
 public:
-  explicit ASCIIBlockCount(const ASCIIMatrix& in_matrix) {
-    count_ = 0;
-    for (int i = 0; i < in_matrix.size(); ++i) {
-      marked_.push_back(false);
-    }
-    for (int i = 0; i < in_matrix.size(); ++i) {
-      if (!marked_[i]){
-	char cur_char = in_matrix.get_element(i);
-	auto found_iter = block_data_.find(cur_char);
-	// This character hasn't been seen before
-	if (found_iter == block_data_.end()) {
-	  BlockMetrics new_metrics;
-	  new_metrics.area = 0;
-	  new_metrics.circumference = 0;
-	  new_metrics.number_blobs = 1;
-	  block_data_[cur_char] = new_metrics;
-	} else {
-	  found_iter->second.number_blobs += 1;
-	}
-	depth_first_search(in_matrix, i, 
-			   &(block_data_[cur_char]));
+  explicit ASCIIBlockCount(const ASCIIMatrix& in_matrix, int n_threads = 1)
+      : parent_(in_matrix.size()) {
+    n_cols_ = in_matrix.n_cols();
+    cells_ = in_matrix.data();
+    int n_rows = in_matrix.n_rows();
+    n_threads = std::max(1, std::min(n_threads, n_rows));
+    vector<int> stripe_rows;
+    for (int t = 0; t <= n_threads; ++t)
+      stripe_rows.push_back(static_cast<long long>(n_rows) * t / n_threads);
+    vector<MetricsTable> tables(n_threads,
+                                MetricsTable(kNumChars, BlockMetrics{0, 0, 0}));
+    run_threads(n_threads, [&](int t) {
+      label_stripe(stripe_rows[t], stripe_rows[t+1], &tables[t]);
+    });
+    // Border t joins the last row of stripe t-1 and the first of stripe t
+    run_threads(n_threads, [&](int t) {
+      if (t > 0)
+	stitch_rows(stripe_rows[t], &tables[t]);
+    });
+    run_threads(n_threads, [&](int t) {
+      count_roots(stripe_rows[t] * n_cols_, stripe_rows[t+1] * n_cols_,
+		  &tables[t]);
+    });
+    block_data_.assign(kNumChars, BlockMetrics{0, 0, 0});
+    for (const auto& table : tables) {
+      for (int ch = 0; ch < kNumChars; ++ch) {
+	block_data_[ch].area += table[ch].area;
+	block_data_[ch].circumference += table[ch].circumference;
+	block_data_[ch].number_blobs += table[ch].number_blobs;
       }
     }
   }
   
   void print_block_data(){
-    printf("Block data\n");
-    for (auto iter = block_data_.cbegin();
-	 iter != block_data_.cend(); ++iter) {
-      char key = iter->first;
-      BlockMetrics met = iter->second;
-      printf("%c: Area: %d\tCirc: %d\tBlobs: %d\n", 
-	     key, met.area, met.circumference, met.number_blobs);
-    }
+    print_metrics_table(block_data_);
   }
+
+  const MetricsTable& block_data() const { return block_data_; }
     
 private:
-  int count_;
-  std::unordered_map<char, BlockMetrics> block_data_;
-  std::vector<bool> marked_;
-  
-  void depth_first_search(const ASCIIMatrix& mat, int idx, 
-			  BlockMetrics* cur_char_metrics) {
-    char cur_char = mat.get_element(idx);
-    int circum = kBlockLength*4;
-    marked_[idx] = true;
-    vector<int> adjacent_idx;
-    mat.get_adjacent_idxs(idx, &adjacent_idx);
-    for (auto iter = adjacent_idx.cbegin(); 
-	 iter != adjacent_idx.cend(); ++iter) {
-      int loop_idx = *iter;
-      char loop_char = mat.get_element(loop_idx);
-      if (loop_char == cur_char)
-	circum -= kBlockLength;
-      if (!marked_[loop_idx] && loop_char == cur_char)
-	depth_first_search(mat, loop_idx, cur_char_metrics);
-    }
-    cur_char_metrics->area += kBlockLength * kBlockLength;
-    cur_char_metrics->circumference += circum;
+  const char* cells_;
+  int n_cols_;
+  // Indexed by the unsigned value of the character
+  MetricsTable block_data_;
+  vector<std::atomic<int>> parent_;
+
+  template <typename Body>
+  static void run_threads(int n_threads, Body body) {
+    if (n_threads == 1) {
+      body(0);
+      return;
+    }
+    vector<std::thread> workers;
+    for (int t = 0; t < n_threads; ++t)
+      workers.emplace_back(body, t);
+    for (auto& worker : workers)
+      worker.join();
+  }
+
+  static BlockMetrics& metrics_for(char ch, MetricsTable* table) {
+    return (*table)[static_cast<unsigned char>(ch)];
+  }
+
+  void label_stripe(int begin_row, int end_row, MetricsTable* table) {
+    INSTR_COUNT(cells_visited,
+		static_cast<long long>(end_row - begin_row) * n_cols_);
+    for (int row = begin_row; row < end_row; ++row) {
+      const char* cur_row = cells_ + static_cast<long long>(row) * n_cols_;
+      const char* prev_row = cur_row - n_cols_;
+      for (int col = 0; col < n_cols_; ++col) {
+	int idx = row * n_cols_ + col;
+	char cur_char = cur_row[col];
+	parent_[idx].store(idx, std::memory_order_relaxed);
+	BlockMetrics& metrics = metrics_for(cur_char, table);
+	metrics.area += kBlockLength * kBlockLength;
+	metrics.circumference += kBlockLength * 4;
+	// Every shared edge hides one side of each of its two cells
+	if (col > 0 && cur_row[col-1] == cur_char) {
+	  metrics.circumference -= kBlockLength * 2;
+	  unite(idx, idx - 1);
+	}
+	if (row > begin_row && prev_row[col] == cur_char) {
+	  metrics.circumference -= kBlockLength * 2;
+	  unite(idx, idx - n_cols_);
+	}
+      }
+    }
+  }
+
+  void stitch_rows(int row, MetricsTable* table) {
+    const char* cur_row = cells_ + static_cast<long long>(row) * n_cols_;
+    const char* prev_row = cur_row - n_cols_;
+    INSTR_COUNT(border_cells_stitched, n_cols_);
+    for (int col = 0; col < n_cols_; ++col) {
+      if (prev_row[col] != cur_row[col])
+	continue;
+      metrics_for(cur_row[col], table).circumference -= kBlockLength * 2;
+      unite(row * n_cols_ + col, (row - 1) * n_cols_ + col);
+    }
+  }
+
+  void count_roots(int begin, int end, MetricsTable* table) {
+    for (int idx = begin; idx < end; ++idx) {
+      if (find(idx) == idx)
+	metrics_for(cells_[idx], table).number_blobs += 1;
+    }
+  }
+
+  // Path halving find. Parents only ever move to a smaller ancestor,
+  // so racing threads at worst skip a halving step.
+  int find(int idx) {
+    int parent = parent_[idx].load(std::memory_order_relaxed);
+    while (parent != idx) {
+      int grandparent = parent_[parent].load(std::memory_order_relaxed);
+      parent_[idx].compare_exchange_weak(parent, grandparent,
+					 std::memory_order_relaxed);
+      idx = grandparent;
+      parent = parent_[idx].load(std::memory_order_relaxed);
+    }
+    return idx;
+  }
+
+  // The smaller index always becomes the root, so every root is the
+  // first cell of its blob in scan order. A root is only relinked with
+  // a compare and swap, retrying if another thread linked it first.
+  void unite(int idx_a, int idx_b) {
+    while (true) {
+      int root_a = find(idx_a);
+      int root_b = find(idx_b);
+      if (root_a == root_b)
+	return;
+      if (root_a > root_b)
+	std::swap(root_a, root_b);
+      int expected = root_b;
+      if (parent_[root_b].compare_exchange_strong(expected, root_a,
+						  std::memory_order_relaxed))
+	return;
+    }
+  }
+};
+
+
+// Area and circumference of every character without labeling blobs.
+// Each row is turned into one bitplane per character (bit c set when
+// column c holds that character), so a 64 bit word covers 64 cells.
+// Equal horizontal neighbours are the set bits of plane & (plane >> 1)
+// and equal vertical neighbours those of plane & previous_plane; each
+// such pair hides two block sides. Blob counts are left at zero.
+MetricsTable bitplane_metrics(const ASCIIMatrix& mat) {
+  INSTR_COUNT(cells_visited, mat.size());
+  MetricsTable table(kNumChars, BlockMetrics{0, 0, 0});
+  const unsigned char* cells =
+      reinterpret_cast<const unsigned char*>(mat.data());
+  int n_cols = mat.n_cols();
+  int n_words = (n_cols + 63) / 64;
+  // Give every character present a dense plane slot
+  vector<int> slot(kNumChars, -1);
+  vector<int> slot_chars;
+  for (int idx = 0; idx < mat.size(); ++idx) {
+    if (slot[cells[idx]] < 0) {
+      slot[cells[idx]] = slot_chars.size();
+      slot_chars.push_back(cells[idx]);
+    }
+  }
+  int n_slots = slot_chars.size();
+  vector<uint64_t> cur_planes(n_slots * n_words);
+  vector<uint64_t> prev_planes(n_slots * n_words, 0);
+  vector<long long> n_cells(n_slots, 0);
+  vector<long long> n_pairs(n_slots, 0);
+  for (int row = 0; row < mat.n_rows(); ++row) {
+    const unsigned char* cur_row = cells + static_cast<long long>(row) * n_cols;
+    std::fill(cur_planes.begin(), cur_planes.end(), 0);
+    for (int col = 0; col < n_cols; ++col) {
+      cur_planes[slot[cur_row[col]] * n_words + col / 64] |=
+	  uint64_t(1) << (col % 64);
+    }
+    for (int s = 0; s < n_slots; ++s) {
+      const uint64_t* plane = cur_planes.data() + s * n_words;
+      const uint64_t* prev_plane = prev_planes.data() + s * n_words;
+      long long cells_in_row = 0;
+      long long pairs_in_row = 0;
+      for (int w = 0; w < n_words; ++w) {
+	uint64_t word = plane[w];
+	cells_in_row += __builtin_popcountll(word);
+	pairs_in_row += __builtin_popcountll(word & (word >> 1));
+	pairs_in_row += __builtin_popcountll(word & prev_plane[w]);
+	// Pair straddling two words
+	if (w + 1 < n_words)
+	  pairs_in_row += (word >> 63) & plane[w+1] & 1;
+      }
+      n_cells[s] += cells_in_row;
+      n_pairs[s] += pairs_in_row;
+    }
+    prev_planes.swap(cur_planes);
+  }
+  for (int s = 0; s < n_slots; ++s) {
+    BlockMetrics& metrics = table[slot_chars[s]];
+    metrics.area = n_cells[s] * kBlockLength * kBlockLength;
+    metrics.circumference = (4 * n_cells[s] - 2 * n_pairs[s]) * kBlockLength;
+  }
+  return table;
+}
+
+
+// Block metrics that stay current while single cells of the map are
+// edited. Every cell carries a node of a union-find forest whose root
+// identifies its blob. Painting a cell merges it into equal
+// neighbouring blobs by union. Removing a cell from its old blob may
+// split that blob. If its equal neighbours stay connected around the
+// ring of 8 cells surrounding it nothing splits, which settles most
+// edits in constant time. Otherwise a breadth-first search runs from
+// each neighbour in lockstep and stops as soon as the fronts meet or
+// all but one have run out, and only the pieces that ran out are
+// relabeled. An edit therefore costs the size of the smaller pieces,
+// never the size of the blob or of the map.
+class IncrementalBlockCount {
+public:
+  explicit IncrementalBlockCount(const ASCIIMatrix& in_matrix)
+      : matrix_(in_matrix), block_data_(kNumChars, BlockMetrics{0, 0, 0}),
+	label_(in_matrix.size(), -1), visit_stamp_(in_matrix.size(), 0),
+	cur_stamp_(0) {
+    for (int idx = 0; idx < matrix_.size(); ++idx) {
+      label_[idx] = new_node();
+      add_cell_metrics(idx);
+      int row = idx / matrix_.n_cols();
+      int col = idx % matrix_.n_cols();
+      if (col > 0 && same_char(idx, idx - 1))
+	unite(label_[idx], label_[idx - 1]);
+      if (row > 0 && same_char(idx, idx - matrix_.n_cols()))
+	unite(label_[idx], label_[idx - matrix_.n_cols()]);
+    }
+    for (int idx = 0; idx < matrix_.size(); ++idx) {
+      if (find(label_[idx]) == label_[idx])
+	metrics_for(matrix_.get_element(idx)).number_blobs += 1;
+    }
+  }
+
+  void set_cell(int row, int col, char ch) {
+    int idx = row * matrix_.n_cols() + col;
+    char old_char = matrix_.get_element(idx);
+    if (old_char == ch)
+      return;
+    // Every edit adds nodes, so the forest is rebuilt from the roots
+    // once it has grown past twice the map
+    if (parent_.size() > 2 * label_.size())
+      compact();
+    remove_cell(idx);
+    matrix_.set_element(idx, ch);
+    label_[idx] = new_node();
+    add_cell_metrics(idx);
+    BlockMetrics& metrics = metrics_for(ch);
+    metrics.number_blobs += 1;
+    int adjacent[4];
+    int n_adjacent = adjacent_idxs(idx, adjacent);
+    for (int i = 0; i < n_adjacent; ++i) {
+      if (same_char(idx, adjacent[i]) &&
+	  unite(label_[idx], label_[adjacent[i]]))
+	metrics.number_blobs -= 1;
+    }
+  }
+
+  const ASCIIMatrix& matrix() const { return matrix_; }
+  const MetricsTable& block_data() const { return block_data_; }
+  void print_block_data() { print_metrics_table(block_data_); }
+
+private:
+  BlockMetrics& metrics_for(char ch) {
+    return block_data_[static_cast<unsigned char>(ch)];
+  }
+
+  bool same_char(int idx_a, int idx_b) const {
+    return matrix_.get_element(idx_a) == matrix_.get_element(idx_b);
+  }
+
+  int adjacent_idxs(int idx, int adjacent[4]) const {
+    int n_cols = matrix_.n_cols();
+    int row = idx / n_cols;
+    int col = idx % n_cols;
+    int n_adjacent = 0;
+    if (col > 0)
+      adjacent[n_adjacent++] = idx - 1;
+    if (col < n_cols - 1)
+      adjacent[n_adjacent++] = idx + 1;
+    if (row > 0)
+      adjacent[n_adjacent++] = idx - n_cols;
+    if (row < matrix_.n_rows() - 1)
+      adjacent[n_adjacent++] = idx + n_cols;
+    return n_adjacent;
+  }
+
+  // Area and the sides of idx not shared with an equal neighbour. A
+  // shared side also stops counting for the neighbour, hence 2 sides.
+  void add_cell_metrics(int idx) {
+    BlockMetrics& metrics = metrics_for(matrix_.get_element(idx));
+    metrics.area += kBlockLength * kBlockLength;
+    metrics.circumference += kBlockLength * 4;
+    int adjacent[4];
+    int n_adjacent = adjacent_idxs(idx, adjacent);
+    for (int i = 0; i < n_adjacent; ++i) {
+      // Only neighbours already painted count during construction
+      if (adjacent[i] < static_cast<int>(label_.size()) &&
+	  label_[adjacent[i]] >= 0 && same_char(idx, adjacent[i]))
+	metrics.circumference -= kBlockLength * 2;
+    }
+  }
+
+  // Takes idx out of its blob, counting any pieces the blob falls into
+  void remove_cell(int idx) {
+    char old_char = matrix_.get_element(idx);
+    BlockMetrics& metrics = metrics_for(old_char);
+    metrics.area -= kBlockLength * kBlockLength;
+    metrics.circumference -= kBlockLength * 4;
+    int adjacent[4];
+    int n_adjacent = adjacent_idxs(idx, adjacent);
+    for (int i = 0; i < n_adjacent; ++i) {
+      if (same_char(idx, adjacent[i]))
+	metrics.circumference += kBlockLength * 2;
+    }
+    int seeds[4];
+    int n_seeds = ring_seeds(idx, seeds);
+    // With no equal neighbour the blob disappears, with one it just
+    // shrinks, and neighbours joined around the ring stay joined
+    if (n_seeds < 2) {
+      metrics.number_blobs -= (n_seeds == 0) ? 1 : 0;
+      return;
+    }
+    metrics.number_blobs += split_pieces(idx, old_char, seeds, n_seeds) - 1;
+  }
+
+  // Walks the 8 cells around idx (N, NE, E, SE, S, SW, W, NW). Cells
+  // next to each other on the ring share a side, so each run of cells
+  // equal to idx is connected without idx. Writes one equal side
+  // neighbour per run that holds one and returns how many there are,
+  // which is 0 exactly when idx has no equal side neighbour.
+  int ring_seeds(int idx, int seeds[4]) const {
+    static const int kRowStep[8] = {-1, -1, 0, 1, 1, 1, 0, -1};
+    static const int kColStep[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+    int n_cols = matrix_.n_cols();
+    int row = idx / n_cols;
+    int col = idx % n_cols;
+    bool equal[8];
+    int first_gap = -1;
+    for (int i = 0; i < 8; ++i) {
+      int r = row + kRowStep[i];
+      int c = col + kColStep[i];
+      equal[i] = r >= 0 && r < matrix_.n_rows() && c >= 0 && c < n_cols &&
+	  same_char(idx, r * n_cols + c);
+      if (!equal[i] && first_gap < 0)
+	first_gap = i;
+    }
+    // A full ring is one run; the caller only needs to know it is not
+    // a split, so a single seed is enough
+    if (first_gap < 0)
+      return 1;
+    int n_seeds = 0;
+    bool run_has_seed = false;
+    for (int k = 1; k <= 8; ++k) {
+      int i = (first_gap + k) % 8;
+      if (!equal[i]) {
+	run_has_seed = false;
+      } else if (i % 2 == 0 && !run_has_seed) {
+	seeds[n_seeds++] = (row + kRowStep[i]) * n_cols + col + kColStep[i];
+	run_has_seed = true;
+      }
+    }
+    return n_seeds;
+  }
+
+  // Searches breadth first from every seed in lockstep through the
+  // cells equal to ch, with idx as a wall. Fronts that meet join one
+  // group. The search ends when a single group is left, or when every
+  // group but one has run out, since a group that ran out holds all of
+  // its piece. Those pieces get fresh labels, the rest keeps the old
+  // root. Returns the number of pieces.
+  int split_pieces(int idx, char ch, const int seeds[4], int n_seeds) {
+    // Each front stamps its cells with its own value above base
+    if (cur_stamp_ > std::numeric_limits<unsigned>::max() - 8) {
+      std::fill(visit_stamp_.begin(), visit_stamp_.end(), 0);
+      cur_stamp_ = 0;
+    }
+    unsigned base = cur_stamp_ + 1;
+    cur_stamp_ += 5;
+    visit_stamp_[idx] = base + 4;
+    int group[4];
+    size_t head[4];
+    for (int f = 0; f < n_seeds; ++f) {
+      group[f] = f;
+      head[f] = 0;
+      fronts_[f].clear();
+      fronts_[f].push_back(seeds[f]);
+      visit_stamp_[seeds[f]] = base + f;
+    }
+    while (true) {
+      int n_groups = 0;
+      int n_live_groups = 0;
+      for (int g = 0; g < n_seeds; ++g) {
+	bool exists = false;
+	bool live = false;
+	for (int f = 0; f < n_seeds; ++f) {
+	  if (group[f] == g) {
+	    exists = true;
+	    live = live || head[f] < fronts_[f].size();
+	  }
+	}
+	n_groups += exists ? 1 : 0;
+	n_live_groups += live ? 1 : 0;
+      }
+      if (n_groups == 1)
+	return 1;
+      if (n_live_groups <= 1)
+	break;
+      for (int f = 0; f < n_seeds; ++f) {
+	if (head[f] == fronts_[f].size())
+	  continue;
+	int cell = fronts_[f][head[f]++];
+	INSTR_COUNT(edit_cells_reflooded, 1);
+	int adjacent[4];
+	int n_adjacent = adjacent_idxs(cell, adjacent);
+	for (int i = 0; i < n_adjacent; ++i) {
+	  int next = adjacent[i];
+	  if (matrix_.get_element(next) != ch)
+	    continue;
+	  unsigned stamp = visit_stamp_[next];
+	  if (stamp < base) {
+	    visit_stamp_[next] = base + f;
+	    fronts_[f].push_back(next);
+	  } else if (stamp < base + 4 && group[stamp - base] != group[f]) {
+	    int from = group[stamp - base];
+	    int to = group[f];
+	    for (int g = 0; g < n_seeds; ++g)
+	      group[g] = (group[g] == from) ? to : group[g];
+	  }
+	}
+      }
+    }
+    // Keep the old root for the group still growing, or for the
+    // largest one if all of them ran out together
+    int keep = -1;
+    bool keep_live = false;
+    size_t keep_size = 0;
+    for (int g = 0; g < n_seeds; ++g) {
+      bool live = false;
+      size_t size = 0;
+      for (int f = 0; f < n_seeds; ++f) {
+	if (group[f] == g) {
+	  live = live || head[f] < fronts_[f].size();
+	  size += fronts_[f].size();
+	}
+      }
+      if (size > 0 && (keep < 0 || live > keep_live ||
+		       (live == keep_live && size > keep_size))) {
+	keep = g;
+	keep_live = live;
+	keep_size = size;
+      }
+    }
+    int n_pieces = 0;
+    for (int g = 0; g < n_seeds; ++g) {
+      int piece_node = -1;
+      for (int f = 0; f < n_seeds; ++f) {
+	if (group[f] != g)
+	  continue;
+	if (piece_node < 0) {
+	  ++n_pieces;
+	  if (g == keep)
+	    break;
+	  piece_node = new_node();
+	}
+	for (int cell : fronts_[f])
+	  label_[cell] = piece_node;
+      }
+    }
+    return n_pieces;
+  }
+
+  // Points every cell straight at a dense id for its blob
+  void compact() {
+    vector<int> dense(parent_.size(), -1);
+    int n_roots = 0;
+    for (size_t idx = 0; idx < label_.size(); ++idx) {
+      int root = find(label_[idx]);
+      if (dense[root] < 0)
+	dense[root] = n_roots++;
+      label_[idx] = dense[root];
+    }
+    parent_.resize(n_roots);
+    for (int node = 0; node < n_roots; ++node)
+      parent_[node] = node;
+  }
+
+  int new_node() {
+    parent_.push_back(parent_.size());
+    return parent_.size() - 1;
+  }
+
+  int find(int node) {
+    while (parent_[node] != node) {
+      parent_[node] = parent_[parent_[node]];
+      node = parent_[node];
+    }
+    return node;
+  }
+
+  // Returns true if two different blobs were merged
+  bool unite(int node_a, int node_b) {
+    int root_a = find(node_a);
+    int root_b = find(node_b);
+    if (root_a == root_b)
+      return false;
+    if (root_a < root_b)
+      parent_[root_b] = root_a;
+    else
+      parent_[root_a] = root_b;
+    return true;
+  }
+
+  ASCIIMatrix matrix_;
+  MetricsTable block_data_;
+  vector<int> label_;
+  vector<int> parent_;
+  vector<unsigned> visit_stamp_;
+  unsigned cur_stamp_;
+  // Search fronts of split_pieces, kept to reuse their memory
+  vector<int> fronts_[4];
+};
+
+
+// Counts blocks while reading the map one row at a time, for maps
+// that do not fit in memory. Only the previous and current rows are
+// kept, together with a union-find table of the components that touch
+// the previous row. After every row the components still present are
+// renumbered densely from 0; a component absent from the row can no
+// longer grow, so its blob is counted and its slot reused. Memory is
+// O(columns) no matter how many rows the map has.
+class StreamingBlockCount {
+public:
+  explicit StreamingBlockCount(FILE* p_file)
+      : block_data_(kNumChars, BlockMetrics{0, 0, 0}) {
+    RowReader reader(p_file);
+    const char* row;
+    int length;
+    n_rows_ = 0;
+    while (reader.next_row(&row, &length)) {
+      if (n_rows_ == 0) {
+	n_cols_ = length;
+      } else if (n_cols_ != length) {
+	printf("Error, collumns are not even\n");
+	break;
+      }
+      cur_row_.assign(row, row + length);
+      add_row();
+      prev_row_.swap(cur_row_);
+      prev_labels_.swap(cur_labels_);
+      ++n_rows_;
+    }
+    // Whatever touches the last row is finished as well
+    for (char ch : component_chars_)
+      block_data_[static_cast<unsigned char>(ch)].number_blobs += 1;
+  }
+
+  void print_block_data() { print_metrics_table(block_data_); }
+  long long n_elements() const {
+    return static_cast<long long>(n_rows_) * n_cols_;
+  }
+
+private:
+  void add_row() {
+    INSTR_COUNT(cells_visited, n_cols_);
+    int n_active = component_chars_.size();
+    cur_labels_.resize(n_cols_);
+    for (int col = 0; col < n_cols_; ++col) {
+      char cur_char = cur_row_[col];
+      BlockMetrics& metrics = block_data_[static_cast<unsigned char>(cur_char)];
+      metrics.area += kBlockLength * kBlockLength;
+      metrics.circumference += kBlockLength * 4;
+      int label = -1;
+      if (col > 0 && cur_row_[col-1] == cur_char) {
+	metrics.circumference -= kBlockLength * 2;
+	label = cur_labels_[col-1];
+      }
+      if (n_rows_ > 0 && prev_row_[col] == cur_char) {
+	metrics.circumference -= kBlockLength * 2;
+	if (label < 0)
+	  label = prev_labels_[col];
+	else
+	  unite(label, prev_labels_[col]);
+      }
+      if (label < 0) {
+	label = parent_.size();
+	parent_.push_back(label);
+	component_chars_.push_back(cur_char);
+      }
+      cur_labels_[col] = label;
+    }
+    // Renumber the components present in this row densely
+    vector<int> new_label(parent_.size(), -1);
+    vector<char> new_chars;
+    for (int col = 0; col < n_cols_; ++col) {
+      int root = find(cur_labels_[col]);
+      if (new_label[root] < 0) {
+	new_label[root] = new_chars.size();
+	new_chars.push_back(component_chars_[root]);
+      }
+      cur_labels_[col] = new_label[root];
+    }
+    // Components from the previous row that did not continue are done
+    for (int label = 0; label < n_active; ++label) {
+      if (find(label) == label && new_label[label] < 0)
+	block_data_[static_cast<unsigned char>(component_chars_[label])]
+	    .number_blobs += 1;
+    }
+    component_chars_.swap(new_chars);
+    parent_.resize(component_chars_.size());
+    for (size_t label = 0; label < parent_.size(); ++label)
+      parent_[label] = label;
+  }
+
+  int find(int label) {
+    while (parent_[label] != label) {
+      parent_[label] = parent_[parent_[label]];
+      label = parent_[label];
+    }
+    return label;
   }
+
+  void unite(int label_a, int label_b) {
+    int root_a = find(label_a);
+    int root_b = find(label_b);
+    if (root_a < root_b)
+      parent_[root_b] = root_a;
+    else if (root_b < root_a)
+      parent_[root_a] = root_b;
+  }
+
+  MetricsTable block_data_;
+  vector<char> prev_row_;
+  vector<char> cur_row_;
+  vector<int> prev_labels_;
+  vector<int> cur_labels_;
+  vector<int> parent_;
+  vector<char> component_chars_;
+  int n_rows_;
+  int n_cols_;
 };
 
 
+// Applies n_edits random single cell edits through
+// IncrementalBlockCount and compares the result with a full recount
+int run_edits(const ASCIIMatrix& ascii_matrix, int n_edits) {
+  IncrementalBlockCount incremental(ascii_matrix);
+  std::mt19937 gen(169);
+  std::uniform_int_distribution<int> pick_row(0, ascii_matrix.n_rows() - 1);
+  std::uniform_int_distribution<int> pick_col(0, ascii_matrix.n_cols() - 1);
+  std::uniform_int_distribution<int> pick_cell(0, ascii_matrix.size() - 1);
+  for (int i = 0; i < n_edits; ++i) {
+    // Paint with a character already on the map
+    char ch = incremental.matrix().get_element(pick_cell(gen));
+    incremental.set_cell(pick_row(gen), pick_col(gen), ch);
+  }
+  incremental.print_block_data();
+  ASCIIBlockCount recount(incremental.matrix());
+  bool match = true;
+  for (int ch = 0; ch < kNumChars; ++ch) {
+    const BlockMetrics& lhs = incremental.block_data()[ch];
+    const BlockMetrics& rhs = recount.block_data()[ch];
+    match = match && lhs.area == rhs.area &&
+	lhs.circumference == rhs.circumference &&
+	lhs.number_blobs == rhs.number_blobs;
+  }
+  printf("Matches full recount: %s\n", match ? "True" : "False");
+  return match ? 0 : -1;
+}
+
+
+// Usage: block_count [--stream | --no-blobs | --edits n] [map_file]
 int main( int argc, const char* argv[] ) {
-  FILE* p_file = fopen(kInputFileName, "r");
+  INSTR_INSTALL_DUMP("block_count");
+  INSTR_SCOPED_TIMER(block_count_timer);
+  bool stream = false;
+  bool no_blobs = false;
+  int n_edits = 0;
+  const char* file_name = kInputFileName;
+  for (int i = 1; i < argc; ++i) {
+    if (string(argv[i]) == "--stream")
+      stream = true;
+    else if (string(argv[i]) == "--no-blobs")
+      no_blobs = true;
+    else if (string(argv[i]) == "--edits" && i + 1 < argc)
+      n_edits = std::atoi(argv[++i]);
+    else
+      file_name = argv[i];
+  }
+  FILE* p_file = fopen(file_name, "r");
   if (p_file == NULL) {
     printf("Error opening file\n");
     return -1;
   }
+  if (stream) {
+    StreamingBlockCount block_count(p_file);
+    printf("Number of Elements: %lld\n", block_count.n_elements());
+    block_count.print_block_data();
+    fclose(p_file);
+    return 0;
+  }
   ASCIIMatrix ascii_matrix(p_file);
+  fclose(p_file);
   printf("Number of Elements: %d\n", ascii_matrix.get_num_elements());
-  ASCIIBlockCount block_count(ascii_matrix);
+  if (no_blobs) {
+    print_metrics_table(bitplane_metrics(ascii_matrix), false);
+    return 0;
+  }
+  if (n_edits > 0)
+    return run_edits(ascii_matrix, n_edits);
+  int n_threads = std::max(1u, std::thread::hardware_concurrency());
+  ASCIIBlockCount block_count(ascii_matrix, n_threads);
   block_count.print_block_data();
 }
-
@@ -0,0 +1,467 @@
+// Runs a solver over many small input files. Files are read ahead of
+// the solvers, solved on a pool of threads and their outputs written
+// in input order, so the time to open and read a file is overlapped
+// with solving the ones before it. Reads go through io_uring when the
+// kernel allows it and through a pool of reader threads otherwise.
+#ifndef DAILY_PROGRAMMER_BATCH_RUNNER_H_
+#define DAILY_PROGRAMMER_BATCH_RUNNER_H_
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// printf into a string, for solvers that build their output in memory
+inline void appendf(std::string* out, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+inline void appendf(std::string* out, const char* format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (n < static_cast<int>(sizeof(buffer))) {
+    out->append(buffer, std::max(n, 0));
+    return;
+  }
+  size_t old_size = out->size();
+  out->resize(old_size + n + 1);
+  va_start(args, format);
+  vsnprintf(&(*out)[old_size], n + 1, format, args);
+  va_end(args);
+  out->resize(old_size + n);
+}
+
+// The regular files in a directory, or the matches of a glob pattern,
+// sorted by name
+inline std::vector<std::string> expand_inputs(const std::string& pattern) {
+  std::vector<std::string> files;
+  struct stat path_stat;
+  if (stat(pattern.c_str(), &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
+    DIR* dir = opendir(pattern.c_str());
+    if (dir == nullptr)
+      return files;
+    while (dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] == '.')
+        continue;
+      std::string name = pattern + "/" + entry->d_name;
+      if (stat(name.c_str(), &path_stat) == 0 && S_ISREG(path_stat.st_mode))
+        files.push_back(name);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+  glob_t matches;
+  if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+    for (size_t i = 0; i < matches.gl_pathc; ++i)
+      files.push_back(matches.gl_pathv[i]);
+  }
+  globfree(&matches);
+  return files;
+}
+
+// Minimal io_uring used only to read whole files: one submission queue
+// entry per read, completions tagged with the caller's value. Nothing
+// here is thread safe; one thread owns the ring.
+class UringReader {
+ public:
+  explicit UringReader(unsigned entries) : ring_fd_(-1), n_queued_(0) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ < 0)
+      return;
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes +
+                    params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap ? sq_ring_ :
+        mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED ||
+        sqes == MAP_FAILED) {
+      close(ring_fd_);
+      ring_fd_ = -1;
+      return;
+    }
+    char* sq = static_cast<char*>(sq_ring_);
+    char* cq = static_cast<char*>(cq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+
+  ~UringReader() {
+    if (ring_fd_ < 0)
+      return;
+    munmap(sqes_, sqes_size_);
+    if (cq_ring_ != sq_ring_)
+      munmap(cq_ring_, cq_ring_size_);
+    munmap(sq_ring_, sq_ring_size_);
+    close(ring_fd_);
+  }
+
+  UringReader(const UringReader&) = delete;
+  UringReader& operator=(const UringReader&) = delete;
+
+  bool ok() const { return ring_fd_ >= 0; }
+
+  // Queues a read into buffer. Returns false if the queue is full.
+  bool queue_read(int fd, char* buffer, unsigned size, uint64_t offset,
+                  uint64_t tag) {
+    unsigned tail = *sq_tail_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+      return false;
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++n_queued_;
+    return true;
+  }
+
+  // Submits everything queued, waits for at least one completion and
+  // calls done(tag, result) for each one. Returns false on error.
+  template <typename Done>
+  bool submit_and_wait(Done done) {
+    int n_submitted = syscall(__NR_io_uring_enter, ring_fd_, n_queued_, 1,
+                              IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (n_submitted < 0 && errno != EINTR)
+      return false;
+    if (n_submitted > 0)
+      n_queued_ -= n_submitted;
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      done(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return true;
+  }
+
+ private:
+  int ring_fd_;
+  unsigned n_queued_;
+  void* sq_ring_;
+  void* cq_ring_;
+  size_t sq_ring_size_;
+  size_t cq_ring_size_;
+  size_t sqes_size_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned* sq_array_;
+  io_uring_sqe* sqes_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+};
+
+// Reads, solves and prints a list of files. Solve is called as
+// solve(file_name, contents, &output) from the solver threads.
+template <typename Solve>
+class BatchRunner {
+ public:
+  BatchRunner(const std::vector<std::string>& files, int n_solvers,
+              Solve solve)
+      : files_(files), n_solvers_(std::max(1, n_solvers)), solve_(solve),
+        slots_(files.size()), n_taken_(0), next_read_(0), n_written_(0),
+        n_failed_(0) {}
+
+  // Writes every output to out in input order. Returns the number of
+  // files that could not be read or solved.
+  int run(FILE* out) {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_solvers_; ++i)
+      threads.emplace_back(&BatchRunner::solve_files, this);
+    threads.emplace_back(&BatchRunner::read_files, this);
+    for (size_t i = 0; i < files_.size(); ++i) {
+      std::string output;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        solved_.wait(lock, [&] { return slots_[i].solved; });
+        output.swap(slots_[i].output);
+        ++n_written_;
+      }
+      window_open_.notify_all();
+      fwrite(output.data(), 1, output.size(), out);
+    }
+    for (auto& thread : threads)
+      thread.join();
+    return n_failed_;
+  }
+
+ private:
+  // Files read but not yet written are limited to this many per solver
+  static const size_t kReadAheadPerSolver = 16;
+  static const unsigned kRingEntries = 64;
+
+  struct Slot {
+    std::string contents;
+    std::string output;
+    bool read = false;
+    bool readable = false;
+    bool solved = false;
+  };
+
+  // Blocks until file i is within the read ahead window
+  void wait_for_window(size_t i) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    window_open_.wait(lock, [&] {
+      return i < n_written_ + kReadAheadPerSolver * n_solvers_;
+    });
+  }
+
+  // Called once per file by the reading side
+  void file_read(size_t i, bool readable) {
+    slots_[i].read = true;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      slots_[i].readable = readable;
+      ready_.push_back(i);
+    }
+    file_ready_.notify_one();
+  }
+
+  // Opens file i and sizes its buffer. Returns the descriptor, or -1
+  // if the file is unreadable or already complete (empty).
+  int open_file(size_t i) {
+    int fd = open(files_[i].c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0 ||
+        !S_ISREG(file_stat.st_mode)) {
+      if (fd >= 0)
+        close(fd);
+      file_read(i, false);
+      return -1;
+    }
+    slots_[i].contents.resize(file_stat.st_size);
+    if (file_stat.st_size == 0) {
+      close(fd);
+      file_read(i, true);
+      return -1;
+    }
+    return fd;
+  }
+
+  void read_files() {
+    {
+      UringReader ring(kRingEntries);
+      if (ring.ok() && read_with_uring(&ring))
+        return;
+    }
+    // Thread pool fallback: the readers block in read() instead. It
+    // also picks up whatever the ring left unfinished.
+    std::vector<std::thread> readers;
+    for (int r = 0; r < n_solvers_; ++r) {
+      readers.emplace_back([this]() {
+        size_t i;
+        while ((i = next_read_.fetch_add(1)) < files_.size()) {
+          if (slots_[i].read)
+            continue;
+          wait_for_window(i);
+          int fd = open_file(i);
+          if (fd < 0)
+            continue;
+          std::string& contents = slots_[i].contents;
+          size_t done = 0;
+          ssize_t n = 0;
+          while (done < contents.size()) {
+            n = pread(fd, &contents[done], contents.size() - done, done);
+            if (n < 0 && errno == EINTR)
+              continue;
+            if (n <= 0)
+              break;
+            done += n;
+          }
+          contents.resize(done);
+          close(fd);
+          file_read(i, n >= 0);
+        }
+      });
+    }
+    for (auto& reader : readers)
+      reader.join();
+  }
+
+  // Keeps up to kRingEntries reads in flight. Short reads are queued
+  // again for the rest of the file. Returns false if the ring failed,
+  // leaving the files it had not finished to the fallback.
+  bool read_with_uring(UringReader* ring) {
+    std::vector<int> fds(files_.size(), -1);
+    std::vector<size_t> done(files_.size(), 0);
+    size_t next_open = 0;
+    unsigned n_in_flight = 0;
+    while (next_open < files_.size() || n_in_flight > 0) {
+      while (next_open < files_.size() && n_in_flight < kRingEntries) {
+        if (n_in_flight > 0) {
+          // Only wait for the window when nothing else can progress
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (next_open >= n_written_ + kReadAheadPerSolver * n_solvers_)
+            break;
+        } else {
+          wait_for_window(next_open);
+        }
+        size_t i = next_open++;
+        int fd = open_file(i);
+        if (fd < 0)
+          continue;
+        fds[i] = fd;
+        ring->queue_read(fd, &slots_[i].contents[0],
+                         slots_[i].contents.size(), 0, i);
+        ++n_in_flight;
+      }
+      if (n_in_flight == 0)
+        continue;
+      bool ok = ring->submit_and_wait([&](uint64_t i, int result) {
+        if (result > 0 && done[i] + result < slots_[i].contents.size()) {
+          done[i] += result;
+          ring->queue_read(fds[i], &slots_[i].contents[done[i]],
+                           slots_[i].contents.size() - done[i], done[i], i);
+          return;
+        }
+        if (result > 0)
+          done[i] += result;
+        slots_[i].contents.resize(done[i]);
+        close(fds[i]);
+        --n_in_flight;
+        file_read(i, result >= 0);
+      });
+      if (!ok) {
+        // The kernel may still write into the buffers of reads in
+        // flight, so those are kept aside and the files read again
+        for (size_t i = 0; i < files_.size(); ++i) {
+          if (fds[i] >= 0 && !slots_[i].read) {
+            close(fds[i]);
+            retired_.emplace_back();
+            retired_.back().swap(slots_[i].contents);
+          }
+        }
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void solve_files() {
+    while (true) {
+      size_t i;
+      bool taken_all;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        file_ready_.wait(lock, [&] {
+          return !ready_.empty() || n_taken_ == files_.size();
+        });
+        if (ready_.empty())
+          return;
+        i = ready_.front();
+        ready_.pop_front();
+        taken_all = ++n_taken_ == files_.size();
+      }
+      // Wake the other solvers so they can exit
+      if (taken_all)
+        file_ready_.notify_all();
+      Slot& slot = slots_[i];
+      std::string output;
+      if (slot.readable) {
+        // A malformed file fails on its own instead of the batch
+        try {
+          solve_(files_[i], slot.contents, &output);
+        } catch (const std::exception& error) {
+          output.clear();
+          appendf(&output, "File: %s could not be solved: %s\n",
+                  files_[i].c_str(), error.what());
+          ++n_failed_;
+        }
+      } else {
+        appendf(&output, "File: %s could not be read\n", files_[i].c_str());
+        ++n_failed_;
+      }
+      std::string().swap(slot.contents);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slot.output.swap(output);
+        slot.solved = true;
+      }
+      solved_.notify_all();
+    }
+  }
+
+  const std::vector<std::string>& files_;
+  int n_solvers_;
+  Solve solve_;
+  std::vector<Slot> slots_;
+  std::mutex mutex_;
+  std::condition_variable file_ready_;
+  std::condition_variable solved_;
+  std::condition_variable window_open_;
+  std::deque<size_t> ready_;
+  size_t n_taken_;
+  std::atomic<size_t> next_read_;
+  size_t n_written_;
+  std::atomic<int> n_failed_;
+  // Buffers of reads the ring abandoned, which outlive the ring
+  std::list<std::string> retired_;
+};
+
+// Runs solve over every file named by pattern (a directory or a glob)
+// on n_solvers threads and prints the outputs in order
+template <typename Solve>
+int run_batch_files(const std::string& pattern, int n_solvers, Solve solve) {
+  std::vector<std::string> files = expand_inputs(pattern);
+  if (files.empty()) {
+    printf("No input files match %s\n", pattern.c_str());
+    return -1;
+  }
+  BatchRunner<Solve> runner(files, n_solvers, solve);
+  int n_failed = runner.run(stdout);
+  fflush(stdout);
+  return n_failed == 0 ? 0 : -1;
+}
+
+#endif  // DAILY_PROGRAMMER_BATCH_RUNNER_H_
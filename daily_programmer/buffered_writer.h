@@ -0,0 +1,138 @@
+// Output helpers shared by the final grades programs. Rows are
+// formatted into a large reusable buffer with hand rolled integer
+// formatting and handed to the kernel one chunk at a time with write,
+// or with pwrite at a precomputed offset when several threads each
+// format their own part of a file.
+#ifndef DAILY_PROGRAMMER_BUFFERED_WRITER_H_
+#define DAILY_PROGRAMMER_BUFFERED_WRITER_H_
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+#include <string_view>
+
+static const size_t kOutputChunkSize = 1 << 20;
+
+// Growable byte buffer. clear() keeps the allocation so the buffer
+// can be reused for every chunk.
+class OutputBuffer {
+ public:
+  OutputBuffer() { buffer_.reserve(kOutputChunkSize + 256); }
+
+  void append(std::string_view str) { buffer_.append(str); }
+  void push_back(char ch) { buffer_.push_back(ch); }
+
+  void append_int(long long value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* cur = end;
+    unsigned long long magnitude = value < 0 ? 0ULL - value : value;
+    do {
+      *--cur = '0' + magnitude % 10;
+      magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0)
+      *--cur = '-';
+    buffer_.append(cur, end - cur);
+  }
+
+  const char* data() const { return buffer_.data(); }
+  size_t size() const { return buffer_.size(); }
+  bool full() const { return buffer_.size() >= kOutputChunkSize; }
+  void clear() { buffer_.clear(); }
+
+ private:
+  std::string buffer_;
+};
+
+// Owns a file descriptor opened for writing. Both write calls retry
+// short writes and EINTR and return false on any other error, such as
+// a full disk. Callers must check them and close(), or the file may
+// silently end early.
+class OutputFile {
+ public:
+  explicit OutputFile(const std::string& file_name) {
+    fd_ = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  ~OutputFile() {
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+  OutputFile(const OutputFile&) = delete;
+  OutputFile& operator=(const OutputFile&) = delete;
+
+  bool is_open() const { return fd_ >= 0; }
+
+  // Some file systems only report a failed write here
+  [[nodiscard]] bool close() {
+    int fd = fd_;
+    fd_ = -1;
+    return fd >= 0 && ::close(fd) == 0;
+  }
+
+  [[nodiscard]] bool write_all(const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t written = ::write(fd_, data, size);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        return false;
+      data += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  // Safe to call from several threads as long as the ranges differ
+  [[nodiscard]] bool write_at(const char* data, size_t size, off_t offset) {
+    while (size > 0) {
+      ssize_t written = ::pwrite(fd_, data, size, offset);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        return false;
+      data += written;
+      size -= written;
+      offset += written;
+    }
+    return true;
+  }
+
+ private:
+  int fd_;
+};
+
+// Sequential writer: callers format into buffer() and call
+// maybe_flush() after each row, which issues one write per chunk.
+// Once a write fails every later call returns false and writes
+// nothing, so callers can stop early. Call flush() at the end to learn
+// whether the last chunk made it.
+class BufferedWriter {
+ public:
+  explicit BufferedWriter(OutputFile* out_file)
+      : out_file_(out_file), ok_(true) {}
+  ~BufferedWriter() { (void)flush(); }
+
+  OutputBuffer* buffer() { return &buffer_; }
+
+  [[nodiscard]] bool maybe_flush() {
+    return buffer_.full() ? flush() : ok_;
+  }
+
+  [[nodiscard]] bool flush() {
+    if (ok_ && buffer_.size() > 0)
+      ok_ = out_file_->write_all(buffer_.data(), buffer_.size());
+    buffer_.clear();
+    return ok_;
+  }
+
+ private:
+  OutputFile* out_file_;
+  OutputBuffer buffer_;
+  bool ok_;
+};
+
+#endif  // DAILY_PROGRAMMER_BUFFERED_WRITER_H_
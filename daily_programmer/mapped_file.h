@@ -0,0 +1,53 @@
+// Read-only mmap of a whole file, shared by the programs that parse
+// large text inputs in place.
+#ifndef DAILY_PROGRAMMER_MAPPED_FILE_H_
+#define DAILY_PROGRAMMER_MAPPED_FILE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+// Read-only memory mapping of a whole file. The mapping lives as long
+// as this object, so string_views into data() stay valid until then.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& file_name) {
+    data_ = nullptr;
+    size_ = 0;
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+      void* addr = mmap(nullptr, file_stat.st_size, PROT_READ,
+                        MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        data_ = static_cast<const char*>(addr);
+        size_ = file_stat.st_size;
+        madvise(addr, size_, MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_ != nullptr)
+      munmap(const_cast<char*>(data_), size_);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool is_open() const { return data_ != nullptr; }
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char* data_;
+  size_t size_;
+};
+
+#endif  // DAILY_PROGRAMMER_MAPPED_FILE_H_
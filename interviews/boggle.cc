@@ -23,22 +23,58 @@ swerving, tee, teeing, teri, tern, tie, tieing, tier, tiers, vie,
 view, viewer, viewers, views, viol, violet, vireo, wee, weeing, weer,
 wei, weir, weirs, welt, welter, weltering, welters, were, wet, wring,
 Score:248
+
+There are two engines. The board-first search above walks every path
+on the board and looks each string up in the dictionary. The
+dictionary-first search indexes the board cells by letter pair and
+traces each dictionary word over the board instead, which is far
+cheaper for small word lists or large boards. solve_board picks
+whichever one the cost model expects to do less work.
 */
 
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<unistd.h>
+
+#include<cerrno>
+#include<csignal>
 #include<cstdio>
+#include<cstdlib>
+#include<cstring>
 #include<fstream>
+#include<limits>
+#include<sstream>
 
 #include<string>
 #include<vector>
 #include<set>
 #include<unordered_set>
 #include<algorithm>
+#include<chrono>
+#include<condition_variable>
+#include<deque>
+#include<future>
+#include<iterator>
+#include<mutex>
+#include<random>
+#include<thread>
+
+#include "../common/instrumentation.h"
 
 using std::set;
 using std::unordered_set;
 using std::string;
 using std::vector;
 
+INSTR_COUNTER(nodes_expanded, "boggle_nodes_expanded");
+INSTR_COUNTER(dictionary_hits, "boggle_dictionary_hits");
+INSTR_COUNTER(words_checked, "boggle_dictionary_words_checked");
+INSTR_COUNTER(path_steps, "boggle_dictionary_path_steps");
+INSTR_COUNTER(board_first_solves, "boggle_board_first_solves");
+INSTR_COUNTER(dictionary_first_solves, "boggle_dictionary_first_solves");
+INSTR_TIMER(search_board_timer, "boggle_search_board");
+INSTR_TIMER(search_dictionary_timer, "boggle_search_dictionary");
+
 // Loads in a set of words (One word for each line) from a file. These
 // words are converted to lowercase and then appended to an unordered
 // set. If the words are less than min_word_len, they are ignored
@@ -68,10 +104,12 @@ void search_recursive(const unordered_set<string>& word_set,
                       const string& board, const int side_len,
                       int i, int j, vector<bool>* visited,
                       set<string>* solutions, string* cur_string) {
+  INSTR_COUNT(nodes_expanded, 1);
   cur_string->push_back(board[i*side_len+j]);
   (*visited)[i*side_len+j] = true;
   // Check if this word is in the dictionary
   if (word_set.count(*cur_string) > 0) {
+    INSTR_COUNT(dictionary_hits, 1);
     solutions->insert(*cur_string);
   }
   // Loop through a square around current point
@@ -98,6 +136,7 @@ void search_recursive(const unordered_set<string>& word_set,
 // Finds all of the words that are common to the boggle board and dictionary
 void search_board(const unordered_set<string>& word_set, const string& board,
                   const int side_len, set<string>* words_found) {
+  INSTR_SCOPED_TIMER(search_board_timer);
   string recurse_string;
   // Initialize visited array to false
   vector<bool> visited(side_len*side_len, false);
@@ -111,6 +150,323 @@ void search_board(const unordered_set<string>& word_set, const string& board,
   return;
 }
 
+// Letter pairs are looked up as (first << 8 | second)
+inline int bigram(char first, char second) {
+  return static_cast<unsigned char>(first) << 8 |
+         static_cast<unsigned char>(second);
+}
+
+// The dictionary words bucketed by their first two letters, for the
+// dictionary-first search. The set is kept for the board-first search.
+class WordIndex {
+ public:
+  explicit WordIndex(const unordered_set<string>& word_set)
+      : word_set_(word_set), total_length_(0) {
+    vector<const string*> sorted;
+    for (const auto& word : word_set) {
+      total_length_ += word.size();
+      if (word.size() < 2)
+        short_words_.push_back(word);
+      else
+        sorted.push_back(&word);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const string* lhs, const string* rhs) {
+                return bigram((*lhs)[0], (*lhs)[1]) <
+                       bigram((*rhs)[0], (*rhs)[1]);
+              });
+    for (const string* word : sorted) {
+      int first_pair = bigram((*word)[0], (*word)[1]);
+      if (buckets_.empty() || buckets_.back().first_pair != first_pair)
+        buckets_.push_back({first_pair, words_.size(), words_.size()});
+      words_.push_back(*word);
+      ++buckets_.back().end;
+    }
+  }
+
+  struct Bucket {
+    int first_pair;
+    size_t begin;
+    size_t end;
+  };
+
+  const unordered_set<string>& word_set() const { return word_set_; }
+  const vector<Bucket>& buckets() const { return buckets_; }
+  const string& word(size_t i) const { return words_[i]; }
+  // Words shorter than a letter pair
+  const vector<string>& short_words() const { return short_words_; }
+  size_t size() const { return word_set_.size(); }
+  double average_length() const {
+    return word_set_.empty() ? 0.0 :
+        static_cast<double>(total_length_) / word_set_.size();
+  }
+
+ private:
+  const unordered_set<string>& word_set_;
+  vector<Bucket> buckets_;
+  vector<string> words_;
+  vector<string> short_words_;
+  size_t total_length_;
+};
+
+// The cells of one board indexed by letter pair: for every pair, the
+// cells holding its first letter next to a cell holding its second
+class BoardIndex {
+ public:
+  // (letter pair, cell)
+  typedef std::pair<int, int> Start;
+
+  BoardIndex(const string& board, int side_len)
+      : board_(board), side_len_(side_len),
+        has_pair_(kNumPairs / 64, 0), has_letter_(256 / 64, 0) {
+    for (int i = 0; i < side_len; ++i) {
+      for (int j = 0; j < side_len; ++j) {
+        int cell = i*side_len+j;
+        set_bit(&has_letter_, static_cast<unsigned char>(board[cell]));
+        size_t cell_begin = starts_.size();
+        for_each_neighbour(cell, [&](int next) {
+          int pair = bigram(board[cell], board[next]);
+          // Two neighbours may hold the same letter
+          for (size_t k = cell_begin; k < starts_.size(); ++k) {
+            if (starts_[k].first == pair)
+              return;
+          }
+          starts_.push_back(std::make_pair(pair, cell));
+          set_bit(&has_pair_, pair);
+        });
+      }
+    }
+    std::sort(starts_.begin(), starts_.end());
+  }
+
+  bool has_letter(char letter) const {
+    return get_bit(has_letter_, static_cast<unsigned char>(letter));
+  }
+  bool has_pair(int pair) const { return get_bit(has_pair_, pair); }
+
+  // Start cells for pair as [*begin, *end)
+  void starts(int pair, const Start** begin, const Start** end) const {
+    auto range = std::equal_range(starts_.data(),
+                                  starts_.data() + starts_.size(),
+                                  std::make_pair(pair, 0),
+                                  [](const Start& lhs, const Start& rhs) {
+                                    return lhs.first < rhs.first;
+                                  });
+    *begin = range.first;
+    *end = range.second;
+  }
+
+  template <typename Visit>
+  void for_each_neighbour(int cell, Visit visit) const {
+    int i = cell / side_len_;
+    int j = cell % side_len_;
+    for (int i_scan = i-1; i_scan <= i+1; ++i_scan) {
+      for (int j_scan = j-1; j_scan <= j+1; ++j_scan) {
+        if (i_scan < 0 || j_scan < 0 ||
+            i_scan >= side_len_ || j_scan >= side_len_ ||
+            (i_scan == i && j_scan == j))
+          continue;
+        visit(i_scan*side_len_+j_scan);
+      }
+    }
+  }
+
+  const string& board() const { return board_; }
+  int n_cells() const { return side_len_ * side_len_; }
+  // Every (letter pair, cell) start, sorted by pair
+  const vector<Start>& all_starts() const { return starts_; }
+
+ private:
+  static const int kNumPairs = 1 << 16;
+
+  static void set_bit(vector<uint64_t>* bits, int i) {
+    (*bits)[i >> 6] |= uint64_t(1) << (i & 63);
+  }
+  static bool get_bit(const vector<uint64_t>& bits, int i) {
+    return (bits[i >> 6] >> (i & 63)) & 1;
+  }
+
+  const string& board_;
+  int side_len_;
+  // Sorted by pair
+  vector<Start> starts_;
+  vector<uint64_t> has_pair_;
+  vector<uint64_t> has_letter_;
+};
+
+// Follows word[depth+1..] from cell, which already holds word[depth],
+// without reusing a cell. Returns true if the whole word fits.
+bool trace_word(const BoardIndex& board_index, const string& word,
+                size_t depth, int cell, vector<bool>* visited) {
+  if (depth + 1 == word.size())
+    return true;
+  (*visited)[cell] = true;
+  bool found = false;
+  board_index.for_each_neighbour(cell, [&](int next) {
+    if (found || (*visited)[next] ||
+        board_index.board()[next] != word[depth+1])
+      return;
+    INSTR_COUNT(path_steps, 1);
+    found = trace_word(board_index, word, depth + 1, next, visited);
+  });
+  (*visited)[cell] = false;
+  return found;
+}
+
+// Finds the same words as search_board by tracing each dictionary word
+// from the cells that start its first letter pair
+void search_dictionary(const WordIndex& words, const BoardIndex& board_index,
+                       set<string>* words_found) {
+  INSTR_SCOPED_TIMER(search_dictionary_timer);
+  for (const auto& word : words.short_words()) {
+    if (!word.empty() && board_index.has_letter(word[0]))
+      words_found->insert(word);
+  }
+  vector<bool> visited(board_index.n_cells(), false);
+  for (const auto& bucket : words.buckets()) {
+    if (!board_index.has_pair(bucket.first_pair))
+      continue;
+    const BoardIndex::Start* begin;
+    const BoardIndex::Start* end;
+    board_index.starts(bucket.first_pair, &begin, &end);
+    for (size_t w = bucket.begin; w < bucket.end; ++w) {
+      const string& word = words.word(w);
+      INSTR_COUNT(words_checked, 1);
+      // Every letter pair in the word has to be somewhere on the board
+      bool possible = true;
+      for (size_t k = 1; possible && k + 1 < word.size(); ++k)
+        possible = board_index.has_pair(bigram(word[k], word[k+1]));
+      for (auto start = begin; possible && start < end; ++start) {
+        if (trace_word(board_index, word, 0, start->second, &visited)) {
+          INSTR_COUNT(dictionary_hits, 1);
+          words_found->insert(word);
+          break;
+        }
+      }
+    }
+  }
+}
+
+// The board-first search expands every path on the board whatever
+// the dictionary, so its cost is the number of self avoiding paths.
+// These are exact up to 4 x 4; larger boards are out of reach. An
+// expansion builds and hashes a string, which measures at about 20
+// of the dictionary-first search's steps.
+double board_first_cost(int side_len) {
+  static const double kPaths[] = {0, 1, 64, 10305, 12029640};
+  static const double kExpansionCost = 20;
+  if (side_len <= 4)
+    return kExpansionCost * kPaths[std::max(0, side_len)];
+  return std::numeric_limits<double>::infinity();
+}
+
+// Estimated steps for the dictionary-first search: indexing the board,
+// a look at every bucket of words, and tracing each word whose first
+// pair is on the board from every one of its start cells
+double dictionary_first_cost(const WordIndex& words,
+                             const BoardIndex& board_index) {
+  double cost = 8.0 * board_index.n_cells() + words.buckets().size();
+  for (const auto& bucket : words.buckets()) {
+    if (!board_index.has_pair(bucket.first_pair))
+      continue;
+    const BoardIndex::Start* begin;
+    const BoardIndex::Start* end;
+    board_index.starts(bucket.first_pair, &begin, &end);
+    cost += static_cast<double>(bucket.end - bucket.begin) *
+            (1 + (end - begin) * words.average_length());
+  }
+  return cost;
+}
+
+enum SearchEngine { kAutoEngine, kBoardFirst, kDictionaryFirst };
+
+// Finds all the words common to the board and dictionary with the
+// given engine, or with the one the cost model prefers
+SearchEngine solve_board(const WordIndex& words, const string& board,
+                         int side_len, set<string>* words_found,
+                         SearchEngine engine = kAutoEngine) {
+  BoardIndex board_index(board, side_len);
+  if (engine == kAutoEngine) {
+    engine = board_first_cost(side_len) <
+        dictionary_first_cost(words, board_index) ?
+        kBoardFirst : kDictionaryFirst;
+  }
+  if (engine == kBoardFirst) {
+    INSTR_COUNT(board_first_solves, 1);
+    search_board(words.word_set(), board, side_len, words_found);
+  } else {
+    INSTR_COUNT(dictionary_first_solves, 1);
+    search_dictionary(words, board_index, words_found);
+  }
+  return engine;
+}
+
+// Dictionary-first search over several boards in a single pass over
+// the dictionary. A table maps every letter pair to a bit mask of the
+// boards holding it, so each word is screened against all the boards
+// at once and only traced on the boards that hold all of its pairs.
+// The table is kept between batches and cleared pair by pair.
+class BoardBatch {
+ public:
+  static const size_t kMaxBoards = 64;
+
+  BoardBatch() : pair_boards_(1 << 16, 0) {}
+
+  // Same words as search_dictionary on each board, into words_found[b]
+  void search(const WordIndex& words, const vector<const BoardIndex*>& boards,
+              const vector<set<string>*>& words_found) {
+    INSTR_SCOPED_TIMER(search_dictionary_timer);
+    INSTR_COUNT(dictionary_first_solves, boards.size());
+    int max_cells = 0;
+    for (size_t b = 0; b < boards.size(); ++b) {
+      max_cells = std::max(max_cells, boards[b]->n_cells());
+      for (const auto& start : boards[b]->all_starts()) {
+        if (pair_boards_[start.first] == 0)
+          used_pairs_.push_back(start.first);
+        pair_boards_[start.first] |= uint64_t(1) << b;
+      }
+      for (const auto& word : words.short_words()) {
+        if (!word.empty() && boards[b]->has_letter(word[0]))
+          words_found[b]->insert(word);
+      }
+    }
+    vector<bool> visited(max_cells, false);
+    for (const auto& bucket : words.buckets()) {
+      uint64_t bucket_boards = pair_boards_[bucket.first_pair];
+      if (bucket_boards == 0)
+        continue;
+      for (size_t w = bucket.begin; w < bucket.end; ++w) {
+        const string& word = words.word(w);
+        INSTR_COUNT(words_checked, 1);
+        uint64_t candidates = bucket_boards;
+        for (size_t k = 1; candidates != 0 && k + 1 < word.size(); ++k)
+          candidates &= pair_boards_[bigram(word[k], word[k+1])];
+        while (candidates != 0) {
+          int b = __builtin_ctzll(candidates);
+          candidates &= candidates - 1;
+          const BoardIndex::Start* begin;
+          const BoardIndex::Start* end;
+          boards[b]->starts(bucket.first_pair, &begin, &end);
+          for (auto start = begin; start < end; ++start) {
+            if (trace_word(*boards[b], word, 0, start->second, &visited)) {
+              INSTR_COUNT(dictionary_hits, 1);
+              words_found[b]->insert(word);
+              break;
+            }
+          }
+        }
+      }
+    }
+    for (int pair : used_pairs_)
+      pair_boards_[pair] = 0;
+    used_pairs_.clear();
+  }
+
+ private:
+  vector<uint64_t> pair_boards_;
+  vector<int> used_pairs_;
+};
+
 // Calculates a boggle score for a set of words
 int calc_score(set<string>* words) {
   int score = 0;
@@ -138,9 +494,520 @@ void print_words(set<string>* solutions) {
     printf("%s, ", iter->c_str());
 }
 
-int main() {
+// Reads newline terminated lines from a socket
+class LineReader {
+ public:
+  explicit LineReader(int fd) : fd_(fd) {}
+
+  bool read_line(string* line) {
+    while (true) {
+      size_t newline = buffer_.find('\n');
+      if (newline != string::npos) {
+        line->assign(buffer_, 0, newline);
+        buffer_.erase(0, newline + 1);
+        return true;
+      }
+      char chunk[4096];
+      ssize_t n_read = read(fd_, chunk, sizeof(chunk));
+      if (n_read < 0 && errno == EINTR)
+        continue;
+      if (n_read <= 0)
+        return false;
+      buffer_.append(chunk, n_read);
+    }
+  }
+
+ private:
+  int fd_;
+  string buffer_;
+};
+
+bool write_all(int fd, const string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    written += n;
+  }
+  return true;
+}
+
+sockaddr_un socket_address(const string& socket_path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+// Returns a connected socket or -1
+int connect_socket(const string& socket_path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr = socket_address(socket_path);
+  if (fd >= 0 &&
+      connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// Value at the given fraction of an unsorted sample
+long long percentile(vector<long long> samples, double fraction) {
+  if (samples.empty())
+    return 0;
+  size_t rank = std::min(samples.size() - 1,
+                         static_cast<size_t>(fraction * samples.size()));
+  std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  return samples[rank];
+}
+
+// Listening socket of the running server, shut down by SIGINT/SIGTERM
+// so the accept loop ends and serve() can drain its connections
+static volatile sig_atomic_t serving_fd = -1;
+
+static void stop_serving(int) {
+  if (serving_fd >= 0)
+    shutdown(serving_fd, SHUT_RDWR);
+}
+
+// Keeps the dictionary resident and answers boards sent over a Unix
+// domain socket. Each connection gets a thread which reads one request
+// line ("<side_len> <board>" or "STATS"), queues the board and waits
+// for the answer ("<score> <word>,<word>,..."). An idle solver thread
+// takes its share of the queue, split evenly with the other idle
+// solvers and at most BoardBatch::kMaxBoards boards, and solves the
+// dictionary-first boards of that micro-batch in one dictionary pass.
+// A lone request is solved at once, and under load the batches grow
+// so the pass is shared by more boards. Latency is measured from the
+// moment a request is queued until its answer is ready. On SIGINT or
+// SIGTERM the server stops accepting, lets every open connection
+// finish the request it is on, and only then stops the solvers.
+class BoggleServer {
+ public:
+  BoggleServer(const WordIndex& words, int n_solvers)
+      : words_(words), n_solvers_(n_solvers), stopping_(false),
+        n_idle_(0), n_served_(0), n_batches_(0),
+        start_time_(std::chrono::steady_clock::now()) {}
+
+  int serve(const string& socket_path) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = socket_address(socket_path);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 ||
+        bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+        listen(listen_fd, 128)) {
+      printf("Could not listen on %s\n", socket_path.c_str());
+      return -1;
+    }
+    printf("Serving on %s with %d solver threads\n",
+           socket_path.c_str(), n_solvers_);
+    fflush(stdout);
+    serving_fd = listen_fd;
+    signal(SIGINT, stop_serving);
+    signal(SIGTERM, stop_serving);
+    vector<std::thread> solvers;
+    for (int i = 0; i < n_solvers_; ++i)
+      solvers.emplace_back(&BoggleServer::solve_batches, this);
+    while (true) {
+      int conn_fd = accept(listen_fd, NULL, NULL);
+      if (conn_fd < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        connections_.insert(conn_fd);
+      }
+      std::thread(&BoggleServer::handle_connection, this, conn_fd).detach();
+    }
+    serving_fd = -1;
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    // Stop reading from every client; a request already queued is still
+    // answered because the solvers keep running until the last
+    // connection thread has exited
+    {
+      std::unique_lock<std::mutex> lock(connections_mutex_);
+      for (int conn_fd : connections_)
+        shutdown(conn_fd, SHUT_RD);
+      connections_done_.wait(lock, [&] { return connections_.empty(); });
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    queue_ready_.notify_all();
+    for (auto& solver : solvers)
+      solver.join();
+    printf("%s", stats().c_str());
+    return 0;
+  }
+
+ private:
+  static const size_t kMaxLatencySamples = 1 << 16;
+
+  struct Request {
+    string board;
+    int side_len;
+    std::chrono::steady_clock::time_point queued;
+    std::promise<string> answer;
+  };
+
+  void handle_connection(int conn_fd) {
+    LineReader reader(conn_fd);
+    string line;
+    while (reader.read_line(&line)) {
+      string reply;
+      if (line == "STATS") {
+        reply = stats();
+      } else {
+        Request request;
+        std::istringstream line_stream(line);
+        line_stream >> request.side_len >> request.board;
+        if (request.side_len <= 0 ||
+            request.board.size() !=
+            static_cast<size_t>(request.side_len) * request.side_len) {
+          reply = "ERROR bad board\n";
+        } else {
+          std::future<string> answer = request.answer.get_future();
+          request.queued = std::chrono::steady_clock::now();
+          {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(std::move(request));
+          }
+          queue_ready_.notify_one();
+          reply = answer.get();
+        }
+      }
+      if (!write_all(conn_fd, reply))
+        break;
+    }
+    // Unregister before closing so serve() never shuts down a reused fd,
+    // and notify only once this thread no longer touches the server
+    std::unique_lock<std::mutex> lock(connections_mutex_);
+    connections_.erase(conn_fd);
+    close(conn_fd);
+    std::notify_all_at_thread_exit(connections_done_, std::move(lock));
+  }
+
+  void solve_batches() {
+    BoardBatch batch_search;
+    vector<Request> batch;
+    batch.reserve(BoardBatch::kMaxBoards);
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++n_idle_;
+        queue_ready_.wait(lock, [&] { return stopping_ || !queue_.empty(); });
+        --n_idle_;
+        if (queue_.empty())
+          return;
+        size_t share = (queue_.size() + n_idle_) / (n_idle_ + 1);
+        size_t n_take = std::min(BoardBatch::kMaxBoards, share);
+        std::move(queue_.begin(), queue_.begin() + n_take,
+                  std::back_inserter(batch));
+        queue_.erase(queue_.begin(), queue_.begin() + n_take);
+        if (!queue_.empty() && n_idle_ > 0)
+          queue_ready_.notify_one();
+      }
+      solve_batch(&batch_search, &batch);
+      batch.clear();
+    }
+  }
+
+  // Boards the cost model gives to the board-first search are solved
+  // one by one, the rest share one dictionary pass
+  void solve_batch(BoardBatch* batch_search, vector<Request>* batch) {
+    vector<BoardIndex> indexes;
+    indexes.reserve(batch->size());
+    vector<set<string>> found(batch->size());
+    vector<const BoardIndex*> shared_boards;
+    vector<set<string>*> shared_found;
+    for (size_t r = 0; r < batch->size(); ++r) {
+      const Request& request = (*batch)[r];
+      indexes.emplace_back(request.board, request.side_len);
+      if (board_first_cost(request.side_len) <
+          dictionary_first_cost(words_, indexes.back())) {
+        INSTR_COUNT(board_first_solves, 1);
+        search_board(words_.word_set(), request.board, request.side_len,
+                     &found[r]);
+      } else {
+        shared_boards.push_back(&indexes.back());
+        shared_found.push_back(&found[r]);
+      }
+    }
+    if (!shared_boards.empty())
+      batch_search->search(words_, shared_boards, shared_found);
+    record_batch();
+    for (size_t r = 0; r < batch->size(); ++r) {
+      Request& request = (*batch)[r];
+      string reply = std::to_string(calc_score(&found[r])) + " ";
+      for (auto iter = found[r].cbegin(); iter != found[r].cend(); ++iter) {
+        if (iter != found[r].cbegin())
+          reply += ',';
+        reply += *iter;
+      }
+      reply += '\n';
+      long long latency = std::chrono::duration_cast<
+          std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                     request.queued).count();
+      record_latency(latency);
+      request.answer.set_value(reply);
+    }
+  }
+
+  // Counted before the answer is sent so STATS never lags behind a reply
+  void record_latency(long long latency) {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    if (latencies_.size() < kMaxLatencySamples)
+      latencies_.push_back(latency);
+    else
+      latencies_[n_served_ % kMaxLatencySamples] = latency;
+    ++n_served_;
+  }
+
+  void record_batch() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    ++n_batches_;
+  }
+
+  string stats() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    std::chrono::duration<double> uptime =
+        std::chrono::steady_clock::now() - start_time_;
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "served %lld batches %lld avg_batch %.2f qps %.1f "
+             "p50_us %lld p99_us %lld\n",
+             n_served_, n_batches_,
+             n_batches_ > 0 ? static_cast<double>(n_served_) / n_batches_ : 0,
+             n_served_ / uptime.count(),
+             percentile(latencies_, 0.5), percentile(latencies_, 0.99));
+    return buffer;
+  }
+
+  const WordIndex& words_;
+  int n_solvers_;
+  std::mutex mutex_;
+  std::condition_variable queue_ready_;
+  std::deque<Request> queue_;
+  bool stopping_;
+  // Solvers waiting for work, who share the queue between them
+  size_t n_idle_;
+  std::mutex connections_mutex_;
+  std::condition_variable connections_done_;
+  set<int> connections_;
+  std::mutex stats_mutex_;
+  long long n_served_;
+  long long n_batches_;
+  vector<long long> latencies_;
+  std::chrono::steady_clock::time_point start_time_;
+};
+
+// Load generator: n_connections threads each send their share of
+// n_requests random side_len x side_len boards, one at a time, and
+// time the round trip.
+int run_client(const string& socket_path, int n_requests,
+               int n_connections, int side_len) {
+  std::mutex mutex;
+  vector<long long> latencies;
+  int n_failed = 0;
+  auto start = std::chrono::steady_clock::now();
+  vector<std::thread> clients;
+  for (int c = 0; c < n_connections; ++c) {
+    clients.emplace_back([&, c]() {
+      int fd = connect_socket(socket_path);
+      if (fd < 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++n_failed;
+        return;
+      }
+      std::mt19937 gen(c);
+      std::uniform_int_distribution<int> letter('a', 'z');
+      LineReader reader(fd);
+      vector<long long> local_latencies;
+      int n_mine = n_requests / n_connections +
+          (c < n_requests % n_connections ? 1 : 0);
+      for (int r = 0; r < n_mine; ++r) {
+        string board(side_len * side_len, 'a');
+        for (char& ch : board)
+          ch = letter(gen);
+        auto sent = std::chrono::steady_clock::now();
+        string reply;
+        if (!write_all(fd, std::to_string(side_len) + " " + board + "\n") ||
+            !reader.read_line(&reply))
+          break;
+        local_latencies.push_back(std::chrono::duration_cast<
+            std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                       sent).count());
+      }
+      close(fd);
+      std::lock_guard<std::mutex> lock(mutex);
+      latencies.insert(latencies.end(), local_latencies.cbegin(),
+                       local_latencies.cend());
+    });
+  }
+  for (auto& client : clients)
+    client.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("Requests: %zu\tFailed connections: %d\n",
+         latencies.size(), n_failed);
+  printf("Client QPS: %.1f\tp50: %lld us\tp99: %lld us\n",
+         latencies.size() / elapsed.count(), percentile(latencies, 0.5),
+         percentile(latencies, 0.99));
+  // Ask the server for its own view
+  int fd = connect_socket(socket_path);
+  if (fd >= 0) {
+    LineReader reader(fd);
+    string reply;
+    if (write_all(fd, "STATS\n") && reader.read_line(&reply))
+      printf("Server: %s\n", reply.c_str());
+    close(fd);
+  }
+  return n_failed == 0 ? 0 : -1;
+}
+
+// Solves one random side_len x side_len board against n_words words
+// drawn from the dictionary with each engine the cost model allows
+int run_engine_bench(const unordered_set<string>& word_set, int side_len,
+                     int n_words) {
+  std::mt19937 gen(46);
+  vector<string> all_words(word_set.cbegin(), word_set.cend());
+  std::sort(all_words.begin(), all_words.end());
+  std::shuffle(all_words.begin(), all_words.end(), gen);
+  unordered_set<string> themed(all_words.cbegin(),
+                               all_words.cbegin() +
+                               std::min<size_t>(n_words, all_words.size()));
+  WordIndex words(themed);
+  std::uniform_int_distribution<int> letter('a', 'z');
+  string board(side_len * side_len, 'a');
+  for (char& ch : board)
+    ch = letter(gen);
+
+  BoardIndex board_index(board, side_len);
+  double board_cost = board_first_cost(side_len);
+  double dictionary_cost = dictionary_first_cost(words, board_index);
+  printf("Board: %d x %d\tWords: %zu\n", side_len, side_len, words.size());
+  printf("Estimated cost: board-first %g\tdictionary-first %g\n",
+         board_cost, dictionary_cost);
+  vector<set<string>> found;
+  const SearchEngine engines[] = {kDictionaryFirst, kBoardFirst};
+  const char* names[] = {"dictionary-first", "board-first"};
+  for (int e = 0; e < 2; ++e) {
+    // The board-first search never finishes on large boards
+    if (engines[e] == kBoardFirst && side_len > 4)
+      continue;
+    found.emplace_back();
+    auto start = std::chrono::steady_clock::now();
+    solve_board(words, board, side_len, &found.back(), engines[e]);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    printf("%s: %f s\tWords found: %zu\tScore: %d\n", names[e],
+           elapsed.count(), found.back().size(), calc_score(&found.back()));
+  }
+  printf("Chosen engine: %s\n",
+         names[board_cost < dictionary_cost ? 1 : 0]);
+  bool agree = found.size() < 2 || found[0] == found[1];
+  if (!agree)
+    printf("Engines disagree\n");
+  return agree ? 0 : -1;
+}
+
+// Solves n_boards random side_len x side_len boards with the
+// dictionary-first search one at a time and in BoardBatch micro-batches
+// of batch_size, and checks that both find the same words
+int run_batch_bench(const WordIndex& words, int side_len, int n_boards,
+                    int batch_size) {
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<int> letter('a', 'z');
+  vector<string> boards(n_boards, string(side_len * side_len, 'a'));
+  for (auto& board : boards) {
+    for (char& ch : board)
+      ch = letter(gen);
+  }
+  vector<set<string>> single(n_boards);
+  auto start = std::chrono::steady_clock::now();
+  for (int b = 0; b < n_boards; ++b) {
+    BoardIndex board_index(boards[b], side_len);
+    search_dictionary(words, board_index, &single[b]);
+  }
+  auto solved_single = std::chrono::steady_clock::now();
+  vector<set<string>> batched(n_boards);
+  BoardBatch batch_search;
+  for (int first = 0; first < n_boards; first += batch_size) {
+    int last = std::min(n_boards, first + batch_size);
+    vector<BoardIndex> indexes;
+    indexes.reserve(last - first);
+    vector<const BoardIndex*> batch_boards;
+    vector<set<string>*> batch_found;
+    for (int b = first; b < last; ++b) {
+      indexes.emplace_back(boards[b], side_len);
+      batch_boards.push_back(&indexes.back());
+      batch_found.push_back(&batched[b]);
+    }
+    batch_search.search(words, batch_boards, batch_found);
+  }
+  auto solved_batched = std::chrono::steady_clock::now();
+  std::chrono::duration<double> single_time = solved_single - start;
+  std::chrono::duration<double> batched_time = solved_batched - solved_single;
+  printf("Boards: %d\tBatch size: %d\n", n_boards, batch_size);
+  printf("One at a time: %f s\tBatched: %f s\n", single_time.count(),
+         batched_time.count());
+  bool agree = single == batched;
+  printf("Batched results match: %s\n", agree ? "True" : "False");
+  return agree ? 0 : -1;
+}
+
+// Usage: boggle
+//        boggle --serve socket_path [n_solver_threads]
+//        boggle --client socket_path n_requests n_connections [side_len]
+//        boggle --bench side_len n_words
+//        boggle --batch-bench side_len n_boards [batch_size]
+int main(int argc, char* argv[]) {
   string file_name = "words";
   const int min_word_len = 3;
+  INSTR_INSTALL_DUMP("boggle");
+  if (argc >= 3 && string(argv[1]) == "--client") {
+    int n_requests = argc >= 4 ? std::atoi(argv[3]) : 1000;
+    int n_connections = argc >= 5 ? std::atoi(argv[4]) : 4;
+    int side_len = argc >= 6 ? std::atoi(argv[5]) : 4;
+    signal(SIGPIPE, SIG_IGN);
+    return run_client(argv[2], n_requests, std::max(1, n_connections),
+                      std::max(1, side_len));
+  }
+  if (argc >= 3 && string(argv[1]) == "--serve") {
+    int n_solvers = argc >= 4 ? std::atoi(argv[3]) :
+        std::max(1u, std::thread::hardware_concurrency());
+    unordered_set<string> word_set;
+    load_words_to_set(file_name, min_word_len, &word_set);
+    printf("Number of dictionary words:\n%lu\n", word_set.size());
+    WordIndex words(word_set);
+    signal(SIGPIPE, SIG_IGN);
+    BoggleServer server(words, std::max(1, n_solvers));
+    return server.serve(argv[2]);
+  }
+  if (argc == 4 && string(argv[1]) == "--bench") {
+    unordered_set<string> word_set;
+    load_words_to_set(file_name, min_word_len, &word_set);
+    return run_engine_bench(word_set, std::max(1, std::atoi(argv[2])),
+                            std::max(0, std::atoi(argv[3])));
+  }
+  if (argc >= 4 && string(argv[1]) == "--batch-bench") {
+    unordered_set<string> word_set;
+    load_words_to_set(file_name, min_word_len, &word_set);
+    WordIndex words(word_set);
+    int batch_size = argc >= 5 ? std::atoi(argv[4]) :
+        BoardBatch::kMaxBoards;
+    batch_size = std::max(1, std::min<int>(batch_size,
+                                           BoardBatch::kMaxBoards));
+    return run_batch_bench(words, std::max(1, std::atoi(argv[2])),
+                           std::max(0, std::atoi(argv[3])), batch_size);
+  }
   const int side_len = 4;
   const string test_board = "boggleinterviews";
   // In 2d the board looks like this:
@@ -154,8 +1021,9 @@ int main() {
   load_words_to_set(file_name, min_word_len, &word_set);
   printf("Number of dictionary words:\n%lu\n", word_set.size());
   // Find all the words in the test board
+  WordIndex words(word_set);
   set<string> test_solutions;
-  search_board(word_set, test_board, side_len, &test_solutions);
+  solve_board(words, test_board, side_len, &test_solutions);
   // Print all of the found words;
   printf("Words Found:\n");
   print_words(&test_solutions);
@@ -25,18 +25,40 @@ Test points:
 -10.000000 10.000000 30.000000 35.000000 90.000000
 Number of regions which contain these points:
 0 5 5 2 0
+
+The 2-D version counts the axis aligned rectangles which contain a
+point (x, y), with each rectangle covering [x_lo, x_hi) x [y_lo, y_hi).
+Every rectangle is replaced by its four corners, weighted +1 at
+(x_lo, y_lo) and (x_hi, y_hi) and -1 at the other two, so the count
+for (x, y) is the weight of the corners with cx <= x and cy <= y. The
++1 and -1 corners are each swept in x order, like the endpoints in
+make_range_interlap, into a wavelet matrix over their y ranks. A
+query is then a binary search in x followed by one rank per bit of
+the y rank: O(log n) time in O(n log n) bits.
+Run with --bench n_rectangles n_queries to time it.
 */
 
+#include <cstdint>
 #include <cstdio>
 
 #include <cstdlib>
 #include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
 #include <vector>
 #include <utility>
 
+#include "../common/instrumentation.h"
+
 using std::vector;
 using std::pair;
 
+INSTR_COUNTER(stabbing_queries, "stabbing_queries");
+INSTR_COUNTER(stabbing_rank_steps, "stabbing_rank_steps");
+INSTR_TIMER(stabbing_build_timer, "stabbing_build");
+
 // Generate random float 
 float random_float(float min, float max) {
   return min + (rand()/( RAND_MAX/(max-min)) );
@@ -107,6 +129,277 @@ int find_count(const vector<float>& points,
     return region_counts[region_index-1];
 }
 
+struct Rectangle {
+  float x_lo;
+  float y_lo;
+  float x_hi;
+  float y_hi;
+};
+
+// Bit vector with constant time rank. Each 64 bit word is stored next
+// to the number of set bits before it, so a rank touches one line.
+class RankBitVector {
+ public:
+  explicit RankBitVector(size_t n_bits = 0) : blocks_(n_bits/64 + 1) {}
+
+  void set(size_t i) { blocks_[i >> 6].bits |= uint64_t(1) << (i & 63); }
+
+  // Fills in the per word counts once every bit has been set
+  void build() {
+    uint64_t total = 0;
+    for (auto& block : blocks_) {
+      block.rank = total;
+      total += __builtin_popcountll(block.bits);
+    }
+  }
+
+  // Number of set bits in [0, i)
+  size_t rank1(size_t i) const {
+    const Block& block = blocks_[i >> 6];
+    uint64_t mask = (uint64_t(1) << (i & 63)) - 1;
+    return block.rank + __builtin_popcountll(block.bits & mask);
+  }
+
+ private:
+  struct Block {
+    uint64_t bits = 0;
+    uint64_t rank = 0;
+  };
+  vector<Block> blocks_;
+};
+
+// Wavelet matrix over a sequence of values in [0, alphabet_size). Level
+// l holds bit l (from the top) of every value, after the values have
+// been stably partitioned by all of the higher bits.
+class WaveletMatrix {
+ public:
+  WaveletMatrix() : n_levels_(0) {}
+
+  WaveletMatrix(vector<uint32_t> values, uint32_t alphabet_size)
+      : n_levels_(1) {
+    while (n_levels_ < 32 && (uint64_t(1) << n_levels_) < alphabet_size)
+      ++n_levels_;
+    size_t n_values = values.size();
+    vector<uint32_t> next(n_values);
+    for (int l = 0; l < n_levels_; ++l) {
+      int shift = n_levels_ - 1 - l;
+      RankBitVector level(n_values);
+      size_t n_zeros = 0;
+      for (size_t i = 0; i < n_values; ++i) {
+        if ((values[i] >> shift) & 1)
+          level.set(i);
+        else
+          next[n_zeros++] = values[i];
+      }
+      size_t n_ones = n_zeros;
+      for (size_t i = 0; i < n_values; ++i) {
+        if ((values[i] >> shift) & 1)
+          next[n_ones++] = values[i];
+      }
+      level.build();
+      levels_.push_back(std::move(level));
+      zeros_.push_back(n_zeros);
+      values.swap(next);
+    }
+  }
+
+  // Number of values less than bound in positions [0, end)
+  size_t count_less(size_t end, uint32_t bound) const {
+    if (n_levels_ == 0 || (uint64_t(bound) >> n_levels_) != 0)
+      return end;
+    INSTR_COUNT(stabbing_rank_steps, 2 * n_levels_);
+    size_t begin = 0;
+    size_t count = 0;
+    for (int l = 0; l < n_levels_; ++l) {
+      size_t ones_begin = levels_[l].rank1(begin);
+      size_t ones_end = levels_[l].rank1(end);
+      if ((bound >> (n_levels_ - 1 - l)) & 1) {
+        // Everything with a 0 here is smaller than bound
+        count += (end - begin) - (ones_end - ones_begin);
+        begin = zeros_[l] + ones_begin;
+        end = zeros_[l] + ones_end;
+      } else {
+        begin -= ones_begin;
+        end -= ones_end;
+      }
+    }
+    return count;
+  }
+
+ private:
+  int n_levels_;
+  vector<RankBitVector> levels_;
+  vector<size_t> zeros_;
+};
+
+// Static structure counting the rectangles which contain a point
+class RectangleStabbing {
+ public:
+  explicit RectangleStabbing(const vector<Rectangle>& rects) {
+    INSTR_SCOPED_TIMER(stabbing_build_timer);
+    size_t n_rects = rects.size();
+    // Rank the y of every rectangle edge with one sort, the edge
+    // index riding along as 2*rect + is_hi
+    vector<pair<float, uint32_t>> y_edges;
+    y_edges.reserve(2 * n_rects);
+    for (size_t i = 0; i < n_rects; ++i) {
+      y_edges.push_back(std::make_pair(rects[i].y_lo, 2 * i));
+      y_edges.push_back(std::make_pair(rects[i].y_hi, 2 * i + 1));
+    }
+    std::sort(y_edges.begin(), y_edges.end());
+    vector<uint32_t> y_ranks(2 * n_rects);
+    for (const auto& edge : y_edges) {
+      if (ys_.empty() || ys_.back() != edge.first)
+        ys_.push_back(edge.first);
+      y_ranks[edge.second] = ys_.size() - 1;
+    }
+    vector<pair<float, uint32_t>>().swap(y_edges);
+
+    vector<pair<float, uint32_t>> plus_corners;
+    vector<pair<float, uint32_t>> minus_corners;
+    plus_corners.reserve(2 * n_rects);
+    minus_corners.reserve(2 * n_rects);
+    for (size_t i = 0; i < n_rects; ++i) {
+      uint32_t lo_rank = y_ranks[2 * i];
+      uint32_t hi_rank = y_ranks[2 * i + 1];
+      plus_corners.push_back(std::make_pair(rects[i].x_lo, lo_rank));
+      plus_corners.push_back(std::make_pair(rects[i].x_hi, hi_rank));
+      minus_corners.push_back(std::make_pair(rects[i].x_hi, lo_rank));
+      minus_corners.push_back(std::make_pair(rects[i].x_lo, hi_rank));
+    }
+    vector<uint32_t>().swap(y_ranks);
+    build_corner_set(&plus_corners, &plus_xs_, &plus_);
+    build_corner_set(&minus_corners, &minus_xs_, &minus_);
+  }
+
+  // Number of rectangles containing (x, y)
+  int count(float x, float y) const {
+    INSTR_COUNT(stabbing_queries, 1);
+    uint32_t y_bound = std::upper_bound(ys_.cbegin(), ys_.cend(), y)
+                       - ys_.cbegin();
+    size_t plus_end = std::upper_bound(plus_xs_.cbegin(), plus_xs_.cend(), x)
+                      - plus_xs_.cbegin();
+    size_t minus_end = std::upper_bound(minus_xs_.cbegin(),
+                                        minus_xs_.cend(), x)
+                       - minus_xs_.cbegin();
+    return static_cast<int>(plus_.count_less(plus_end, y_bound)) -
+           static_cast<int>(minus_.count_less(minus_end, y_bound));
+  }
+
+  // count() for every (xs[i], ys[i]), split over n_threads. Each
+  // thread answers its points in x order: neighbouring queries then
+  // walk nearby positions in every level of the matrices.
+  void count_batch(const vector<float>& xs, const vector<float>& ys,
+                   vector<int>* counts, int n_threads = 1) const {
+    size_t n_points = xs.size();
+    counts->resize(n_points);
+    vector<std::thread> workers;
+    for (int t = 0; t < n_threads; ++t) {
+      size_t begin = n_points * t / n_threads;
+      size_t end = n_points * (t + 1) / n_threads;
+      workers.emplace_back([&, begin, end]() {
+        vector<uint32_t> order(end - begin);
+        for (size_t i = begin; i < end; ++i)
+          order[i - begin] = i;
+        std::sort(order.begin(), order.end(),
+                  [&](uint32_t lhs, uint32_t rhs) {
+                    return xs[lhs] < xs[rhs];
+                  });
+        int* out = counts->data();
+        for (uint32_t i : order)
+          out[i] = count(xs[i], ys[i]);
+      });
+    }
+    for (auto& worker : workers)
+      worker.join();
+  }
+
+ private:
+  // Sweeps the (x, y rank) corners in x order, keeping their xs for
+  // the binary search and their y ranks for the wavelet matrix
+  void build_corner_set(vector<pair<float, uint32_t>>* corners,
+                        vector<float>* xs, WaveletMatrix* matrix) {
+    std::sort(corners->begin(), corners->end());
+    vector<uint32_t> y_ranks;
+    xs->reserve(corners->size());
+    y_ranks.reserve(corners->size());
+    for (const auto& corner : *corners) {
+      xs->push_back(corner.first);
+      y_ranks.push_back(corner.second);
+    }
+    vector<pair<float, uint32_t>>().swap(*corners);
+    *matrix = WaveletMatrix(std::move(y_ranks), ys_.size());
+  }
+
+  // Sorted distinct y of every corner
+  vector<float> ys_;
+  vector<float> plus_xs_;
+  vector<float> minus_xs_;
+  WaveletMatrix plus_;
+  WaveletMatrix minus_;
+};
+
+// Times building and querying n_rects random rectangles and checks a
+// sample of the queries against a linear scan
+int run_stabbing_bench(int n_rects, int n_queries, int n_threads) {
+  std::mt19937 gen(45);
+  std::uniform_real_distribution<float> coord(0.0, 1000.0);
+  std::uniform_real_distribution<float> side(0.0, 50.0);
+  vector<Rectangle> rects(n_rects);
+  for (auto& rect : rects) {
+    rect.x_lo = coord(gen);
+    rect.y_lo = coord(gen);
+    rect.x_hi = rect.x_lo + side(gen);
+    rect.y_hi = rect.y_lo + side(gen);
+  }
+  vector<float> xs(n_queries);
+  vector<float> ys(n_queries);
+  for (int i = 0; i < n_queries; ++i) {
+    xs[i] = coord(gen);
+    ys[i] = coord(gen);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  RectangleStabbing stabbing(rects);
+  auto built = std::chrono::steady_clock::now();
+  long long total = 0;
+  for (int i = 0; i < n_queries; ++i)
+    total += stabbing.count(xs[i], ys[i]);
+  auto queried = std::chrono::steady_clock::now();
+  vector<int> counts;
+  stabbing.count_batch(xs, ys, &counts, n_threads);
+  auto batched = std::chrono::steady_clock::now();
+
+  // Keep the linear scan to a couple of hundred million tests
+  int n_checked = std::min<long long>(n_queries,
+                                      std::max(1, 200000000 / std::max(1, n_rects)));
+  int mismatches = 0;
+  for (int i = 0; i < n_checked; ++i) {
+    int expected = 0;
+    for (const auto& rect : rects) {
+      expected += rect.x_lo <= xs[i] && xs[i] < rect.x_hi &&
+                  rect.y_lo <= ys[i] && ys[i] < rect.y_hi;
+    }
+    mismatches += counts[i] != expected;
+  }
+  for (int i = 0; i < n_queries; ++i)
+    total -= counts[i];
+
+  std::chrono::duration<double> build_time = built - start;
+  std::chrono::duration<double> query_time = queried - built;
+  std::chrono::duration<double> batch_time = batched - queried;
+  printf("Rectangles: %d\tQueries: %d\tThreads: %d\n",
+         n_rects, n_queries, n_threads);
+  printf("Build: %f s\n", build_time.count());
+  printf("Single queries: %f s (%.1f ns/query)\n", query_time.count(),
+         1e9 * query_time.count() / std::max(1, n_queries));
+  printf("Batched queries: %f s (%.1f ns/query)\n", batch_time.count(),
+         1e9 * batch_time.count() / std::max(1, n_queries));
+  printf("Checked: %d\tMismatches: %d\n", n_checked,
+         mismatches + (total != 0));
+  return mismatches == 0 && total == 0 ? 0 : -1;
+}
+
 void print_float(float const input) {
   printf("%f ", input);
   return;
@@ -117,7 +410,14 @@ void print_int(int const input) {
   return;
 }
 
+// Usage: region_count [--bench n_rectangles n_queries]
 int main(int argc, char *argv[]) {
+  INSTR_INSTALL_DUMP("region_count");
+  if (argc == 4 && std::string(argv[1]) == "--bench") {
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+    return run_stabbing_bench(std::atoi(argv[2]), std::atoi(argv[3]),
+                              n_threads);
+  }
   // Create vector containing the regions as pairs
   vector<pair<float, float>> ranges;
   const int num_ranges = 15;